@@ -103,9 +103,60 @@ typedef enum {
     OP_BXOR = 73,
     OP_BSHL = 74,
     OP_BSHR = 75,
-    OP_BNOT = 76
+    OP_BNOT = 76,
+    /* superinstructions, only emitted by sharkc's cx target. Each one stands
+    ** for the sequence in its name and takes the operands of the ops it
+    ** replaces, in order. */
+    OP_LOAD_LOAD = 77,
+    OP_LOAD_CONST = 78,
+    OP_SELF_GET_FIELD = 79,
+    OP_LOAD_RETURN = 80,
+    OP_STORE_AU = 81,
+    OP_EQ_IF = 82,
+    OP_NE_IF = 83,
+    OP_LT_IF = 84,
+    OP_LE_IF = 85,
+    OP_GT_IF = 86,
+    OP_GE_IF = 87,
+    OP_LOAD_LOAD_LT_IF = 88,
+    /* three address instructions, only emitted by sharkc's c2 target. The
+    ** destination is a local slot (or SHARK_REG_PUSH to push the result)
+    ** and each source is a 16 bit register operand (see SHARK_REG_CONST). */
+    OP_MOVE = 89,
+    OP_ADD_R = 90,
+    OP_SUB_R = 91,
+    OP_MUL_R = 92,
+    OP_DIV_R = 93,
+    OP_MOD_R = 94,
+    OP_EQ_R_IF = 95,
+    OP_NE_R_IF = 96,
+    OP_LT_R_IF = 97,
+    OP_LE_R_IF = 98,
+    OP_GT_R_IF = 99,
+    OP_GE_R_IF = 100,
+    /* quickened forms, written over the generic ones by the vm and never
+    ** emitted by sharkc (see shark_vm_quicken_field). */
+    OP_GET_FIELD_IC = 128,
+    OP_SET_FIELD_IC = 129,
+    OP_GET_FIELD_TOP_IC = 130,
+    OP_SET_FIELD_AU_IC = 131,
+    OP_METHOD_CALL_IC = 132,
+    OP_ADD_NUM = 133,
+    OP_SUB_NUM = 134,
+    OP_MUL_NUM = 135,
+    OP_DIV_NUM = 136,
+    OP_LT_NUM = 137,
+    OP_LE_NUM = 138,
+    OP_GT_NUM = 139,
+    OP_GE_NUM = 140,
+    OP_SELF_GET_FIELD_IC = 141
 } shark_opcode;
 
+/* Register operands name a local slot, or a constant when SHARK_REG_CONST is
+** set (the constant index is in the low bits). */
+#define SHARK_REG_PUSH      0xFF
+#define SHARK_REG_CONST     0x8000
+
 typedef enum {
     CONST_INT = 0,
     CONST_FLOAT,
@@ -230,8 +281,22 @@ SHARK_API void *shark_malloc(size_t object_size);
 SHARK_API void *shark_realloc(void *object, size_t new_size);
 SHARK_API void *shark_calloc(size_t count, size_t object_size);
 
+SHARK_API void shark_free(void *object);
+
 #define shark_zalloc(object_size)   shark_calloc(1, object_size)
-#define shark_free(object)          free(object)
+
+/* Blocks of up to SHARK_POOL_MAX_SIZE bytes (objects, small strings and the
+** backing store of small arrays and tables) come from size class pools: each
+** class keeps a free list and new blocks are cut from big chunks. Every block
+** starts with a word that tells its class, so shark_free doesn't need the
+** size. Build with SHARK_NO_POOL to use the C allocator directly (for memory
+** checkers). */
+#ifndef SHARK_NO_POOL
+    #define SHARK_POOL_GRANULE      16
+    #define SHARK_POOL_CLASSES      16
+    #define SHARK_POOL_MAX_SIZE     (SHARK_POOL_GRANULE * SHARK_POOL_CLASSES - sizeof(size_t))
+    #define SHARK_POOL_CHUNK_SIZE   (64 * 1024)
+#endif
 
 typedef struct _shark_class shark_class;
 
@@ -242,6 +307,7 @@ struct _shark_object
 };
 
 typedef struct shark_table shark_table;
+typedef struct shark_shape shark_shape;
 
 struct _shark_class
 {
@@ -253,6 +319,8 @@ struct _shark_class
     void (*destroy)(shark_object *);
     bool is_object_class;
     shark_table *methods;
+    shark_shape *shape;
+    void (*traverse)(shark_object *, void (*)(shark_object *));
 };
 
 SHARK_API void *shark_object_new(shark_class *type);
@@ -262,6 +330,46 @@ SHARK_API void shark_default_destroy(shark_object *self);
 SHARK_API void *shark_object_inc_ref(void *self);
 SHARK_API void shark_object_dec_ref(void *self);
 
+/* Slots of the vm stack don't hold references (the counting is deferred), so
+** an object whose count drops to zero may still be in use. It's flagged and
+** queued in the zero count table instead, shark_vm_reconcile frees the ones
+** no stack slot points to. */
+#define SHARK_ZCT_FLAG          (((size_t) 1) << (sizeof(size_t) * 8 - 1))
+#ifndef SHARK_ZCT_INIT_SIZE
+    #define SHARK_ZCT_INIT_SIZE 1024
+#endif
+
+/* Cycles are found by trial deletion (Bacon and Rajan): an object whose count
+** drops but not to zero may be the last outside reference into a garbage
+** cycle, so objects whose class can refer to others are buffered as candidate
+** roots when that happens. Once the buffer holds 'threshold' roots the next
+** safepoint subtracts the references among everything reachable from them
+** and frees whatever has none left. The flag and color bits live at the top
+** of ref_count, under the zct flag. */
+#define SHARK_GC_BUFFERED       (SHARK_ZCT_FLAG >> 1)
+#define SHARK_GC_GRAY           (SHARK_ZCT_FLAG >> 2)
+#define SHARK_GC_WHITE          (SHARK_ZCT_FLAG >> 3)
+#define SHARK_GC_COLOR          (SHARK_GC_GRAY | SHARK_GC_WHITE)
+
+/* Set on strings in the intern table (see shark_string_intern). */
+#define SHARK_STRING_INTERNED   (SHARK_ZCT_FLAG >> 4)
+
+#define SHARK_REF_COUNT_MASK    (SHARK_STRING_INTERNED - 1)
+
+#ifndef SHARK_GC_THRESHOLD
+    #define SHARK_GC_THRESHOLD  10000
+#endif
+
+typedef struct {
+    size_t threshold;
+    size_t roots;
+    size_t collections;
+    size_t collected;
+} shark_gc_stats;
+
+SHARK_API shark_gc_stats shark_gc_get_stats();
+SHARK_API void shark_gc_set_threshold(size_t threshold);
+
 SHARK_API bool shark_object_instanceof(shark_object *self, shark_class *type);
 
 SHARK_API shark_value shark_value_inc_ref(shark_value self);
@@ -303,23 +411,55 @@ struct shark_string
     shark_object super;
     size_t size;
     size_t hash;
-    uint8_t *data;
+    uint8_t data[];
 };
 
 SHARK_API size_t shark_hash_byte_str(size_t length, uint8_t *data);
 
 SHARK_API void shark_string_init(shark_string *self);
+SHARK_API size_t shark_string_hash(shark_string *self);
 
 SHARK_API void *shark_string_new_with_size(size_t size);
 SHARK_API void *shark_string_new_from_byte_str(size_t size, uint8_t *data);
 SHARK_API void *shark_string_new_from_cstr(char *data);
 
+/* Strings are a single block, so resizing one may move it. Only for strings
+** being built, that nothing else points to yet. */
+SHARK_API shark_string *shark_string_resize(shark_string *self, size_t size);
+
 SHARK_API bool shark_string_equals(shark_string *self, shark_string *other);
 
+/* Interned strings are unique by content, two of them are equal only if
+** they're the same object. The loader interns every constant, natives can
+** opt in. shark_string_intern takes a (hashed) string and returns the one
+** in the table, the reference passed in is moved to the result. The table
+** doesn't hold references, strings leave it when they're freed. */
+#ifndef SHARK_INTERN_INIT_SIZE
+    #define SHARK_INTERN_INIT_SIZE  256
+#endif
+
+SHARK_API shark_string *shark_string_intern(shark_string *self);
+SHARK_API shark_string *shark_string_find_interned(size_t size, uint8_t *data);
+
+/* Arrays start out numeric, holding no objects (numbers and the other
+** values that aren't references), so storing into them counts no
+** references and neither freeing nor collecting them walks the elements.
+** The first object stored turns an array generic for good. */
+typedef enum {
+    SHARK_ARRAY_NUMERIC = 0,
+    SHARK_ARRAY_GENERIC
+} shark_array_kind;
+
+/* 'data' points at the first element, which needn't be the start of the
+** buffer: removals at the front just move it up and leave 'head' free
+** slots behind, insertions at the front take them back. 'size' counts the
+** slots from 'data' on. */
 typedef struct {
     shark_object super;
+    shark_array_kind kind;
     size_t length;
     size_t size;
+    size_t head;
     shark_value *data;
 } shark_array;
 
@@ -331,6 +471,10 @@ SHARK_API void *shark_array_new();
 SHARK_API void shark_array_preallocate(shark_array *self, size_t size);
 SHARK_API void shark_array_grow(shark_array *self);
 SHARK_API void shark_array_put(shark_array *self, shark_value value);
+SHARK_API void shark_array_set(shark_array *self, size_t index, shark_value value);
+SHARK_API void shark_array_insert(shark_array *self, size_t index, shark_value value);
+SHARK_API shark_value shark_array_remove(shark_array *self, size_t index);
+SHARK_API void shark_array_fill(shark_array *self, size_t index, shark_array *source, size_t start, size_t count);
 SHARK_API void shark_array_shrink(shark_array *self);
 SHARK_API shark_value shark_array_pop(shark_array *self);
 
@@ -340,6 +484,31 @@ typedef struct {
     shark_value value;
 } shark_table_slot;
 
+/* Build with SHARK_TABLE_SWISS to probe hashed tables a group of 16 slots at
+** a time: a separate array keeps one control byte per slot (a 7 bit tag of
+** the hash, or empty / deleted) and a whole group is matched against the tag
+** at once (with SSE2 where available), so a lookup only touches the slots
+** whose tag matched. The slot array and the shark_table_* API stay the same. */
+#define SHARK_TABLE_GROUP_SIZE      16
+
+/* Build with SHARK_TABLE_INCREMENTAL to spread the rebuilds of hashed tables
+** out: the old slot array is kept next to the new one, every lookup moves a
+** bounded number of its slots over, and a key found in it is moved right
+** away. Only the default engine rebuilds this way. */
+#ifdef SHARK_TABLE_SWISS
+    #undef SHARK_TABLE_INCREMENTAL
+#endif
+
+/* Build with SHARK_TABLE_COMPACT to keep the slots of hashed tables dense and
+** in insertion order: 'data' only holds the entries (removed ones leave a
+** hole until the next rebuild) and the hashed part is a small array of entry
+** numbers, one to eight bytes wide depending on the table size. Walking or
+** copying a table only touches its entries. */
+#ifdef SHARK_TABLE_COMPACT
+    #undef SHARK_TABLE_SWISS
+    #undef SHARK_TABLE_INCREMENTAL
+#endif
+
 struct shark_table
 {
     shark_object super;
@@ -347,10 +516,53 @@ struct shark_table
     size_t size;
     size_t mask;
     shark_table_slot *data;
+#if defined(SHARK_TABLE_SWISS)
+    uint8_t *ctrl;
+    size_t growth;
+#elif defined(SHARK_TABLE_COMPACT)
+    void *index;
+    size_t used;
+    size_t filled;
+#else
+    size_t deleted;
+#endif
+#ifdef SHARK_TABLE_INCREMENTAL
+    shark_table_slot *old_data;
+    size_t old_size;
+    size_t migrated;
+#endif
+    shark_shape *shape;
+    size_t capacity;
+    shark_value *fields;
 };
 
 #define SHARK_TABLE_INIT_SIZE       4
 
+#ifndef SHARK_TABLE_REHASH_STEP
+    #define SHARK_TABLE_REHASH_STEP     32
+#endif
+
+/* Instances of script classes start out 'shaped': instead of a hash array
+** they hold a shape, shared with every instance that got the same fields in
+** the same order, plus a flat array of field values indexed through it.
+** Each class owns the root of its own transition tree. A table falls back to
+** the regular hashed layout when a key is deleted or the tree grows past the
+** limits below. */
+struct shark_shape
+{
+    shark_object super;
+    size_t count;
+    shark_table *offsets;
+    shark_table *transitions;
+};
+
+#define SHARK_SHAPE_INIT_FIELDS         4
+#define SHARK_SHAPE_MAX_FIELDS          64
+#define SHARK_SHAPE_MAX_TRANSITIONS     16
+
+SHARK_API shark_shape *shark_shape_new();
+SHARK_API shark_table *shark_table_new_shaped(shark_shape *shape);
+
 #define SHARK_TABLE_HASH_NULL       0
 #define SHARK_TABLE_HASH_NOT_NULL   1
 
@@ -372,6 +584,36 @@ SHARK_API shark_value shark_table_pop_index(shark_table *self, shark_value key);
 
 SHARK_API void shark_table_update(shark_table *self, shark_table *other);
 
+typedef struct {
+    shark_value name;
+    shark_value key;
+    size_t slot;
+    shark_shape *shape;
+    shark_shape *next;
+    size_t index;
+} shark_field_cache;
+
+#define SHARK_FIELD_CACHE_INIT_SIZE     8
+#define SHARK_FIELD_CACHE_MAX           65535
+
+SHARK_API shark_value shark_table_get_cached(shark_table *self, shark_field_cache *cache);
+SHARK_API void shark_table_set_cached(shark_table *self, shark_field_cache *cache, shark_value value);
+
+/* Per call site cache of the methods a call resolved to, keyed on the class
+** of the receiver. Entries are only valid for the epoch they were filled in,
+** the vm starts a new epoch whenever a method is installed in a class. */
+#define SHARK_METHOD_CACHE_WAYS         4
+#define SHARK_METHOD_CACHE_INIT_SIZE    8
+#define SHARK_METHOD_CACHE_MAX          65535
+
+typedef struct {
+    shark_value name;
+    size_t epoch;
+    size_t next;
+    shark_class *type[SHARK_METHOD_CACHE_WAYS];
+    struct shark_function *method[SHARK_METHOD_CACHE_WAYS];
+} shark_method_cache;
+
 typedef struct {
     shark_object super;
     shark_string *name;
@@ -380,6 +622,14 @@ typedef struct {
     size_t const_table_size;
     shark_value *const_table;
     uint8_t *code;
+    size_t code_size;
+    shark_object *code_map;
+    size_t field_cache_count;
+    size_t field_cache_size;
+    shark_field_cache *field_cache;
+    size_t method_cache_count;
+    size_t method_cache_size;
+    shark_method_cache *method_cache;
 } shark_module;
 
 SHARK_API shark_string *shark_path_get_base(shark_string *path);
@@ -397,7 +647,16 @@ typedef struct shark_vm shark_vm;
 
 typedef shark_value (*shark_native_function)(shark_vm *, shark_value *, shark_error *);
 
+/* The template JIT in cshark_jit.c needs x86-64 and mmap, it's built in
+** where those are available (unless SHARK_NO_JIT is defined) and turned on
+** at runtime with the SHARK_JIT environment variable. */
+#if !defined(SHARK_NO_JIT) && !defined(SHARK_UNBOX) && !defined(SHARK_PROFILE_OPCODES) \
+    && defined(__x86_64__) && defined(__linux__) && (defined(__GNUC__) || defined(__clang__))
+    #define SHARK_JIT
+#endif
+
 typedef struct shark_function shark_function;
+typedef struct shark_jit_code shark_jit_code;
 
 struct shark_function
 {
@@ -413,10 +672,26 @@ struct shark_function
         shark_native_function native_code;
         uint8_t *bytecode;
     } code;
+    size_t code_size;
+#ifdef SHARK_JIT
+    size_t hotness;
+    size_t jit_compiles;
+    shark_jit_code *jit;
+#endif
 };
 
 typedef struct shark_vm_frame shark_vm_frame;
 
+/* What the interpreter does with the result when a frame returns. Entry
+** frames return from shark_vm_execute, the others belong to calls made by
+** the dispatch loop itself and resume their parent. */
+typedef enum {
+    SHARK_CALL_ENTRY = 0,
+    SHARK_CALL_FUNCTION,
+    SHARK_CALL_METHOD,
+    SHARK_CALL_NEW
+} shark_vm_call;
+
 struct shark_vm_frame
 {
     shark_vm_frame *parent;
@@ -426,6 +701,20 @@ struct shark_vm_frame
     shark_value *const_table;
     size_t base;
     uint8_t *code;
+    shark_vm_call call;
+};
+
+/* Bytecode frames live in a list of chunks owned by the vm, so a frame never
+** moves while it's in use and call depth isn't bound by the C stack. */
+#define SHARK_VM_FRAME_CHUNK_SIZE   256
+
+typedef struct shark_vm_frame_chunk shark_vm_frame_chunk;
+
+struct shark_vm_frame_chunk
+{
+    shark_vm_frame_chunk *prev;
+    shark_vm_frame_chunk *next;
+    shark_vm_frame frames[SHARK_VM_FRAME_CHUNK_SIZE];
 };
 
 struct shark_vm
@@ -433,12 +722,17 @@ struct shark_vm
     shark_object super;
     shark_array *import_path;
     size_t max_import_path;
+    shark_table *import_listing;
     shark_table *archive_record;
     shark_table *module_record;
     shark_table *import_record;
     shark_vm_frame *bottom;
+    shark_vm_frame_chunk *frame_chunk;
+    size_t frame_count;
     shark_error *error;
+    size_t method_epoch;
     size_t stack_size;
+    size_t stack_limit;
     size_t TOS;
     shark_value *stack;
 };
@@ -446,11 +740,27 @@ struct shark_vm
 SHARK_API void shark_print_stack_trace(shark_vm *vm);
 SHARK_API shark_module *shark_read_archive(shark_vm *vm, shark_string *name, void *source_file);
 
-#define SHARK_VM_STACK_INIT_SIZE    32
-#define SHARK_VM_STACK_GROW_SIZE(x) (x << 1)
+/* Values in the operand stack. It's allocated once at this size and never
+** moves. With mmap or VirtualAlloc the memory is only reserved up front,
+** elsewhere it's all allocated with the vm so the default is a small one. */
+#ifndef SHARK_VM_STACK_SIZE
+    #if defined(__unix__) || defined(__APPLE__)
+        #define SHARK_VM_STACK_SIZE     (1 << 24)
+    #elif defined(_WIN32)
+        #define SHARK_VM_STACK_SIZE     (1 << 22)
+    #else
+        #define SHARK_VM_STACK_SIZE     (1 << 14)
+    #endif
+#endif
 
 SHARK_API shark_vm *shark_vm_new();
 SHARK_API shark_module *shark_vm_bind_module(shark_vm *vm, char *name);
+
+/* Native modules can be registered instead of bound, the function binding
+** their contents then only runs if a program imports them. */
+typedef void (*shark_module_binder)(shark_vm *vm, shark_module *module);
+
+SHARK_API void shark_vm_register_module(shark_vm *vm, char *name, shark_module_binder bind);
 SHARK_API shark_class *shark_vm_bind_class(shark_vm *vm, shark_module *module, char *name, size_t object_size, void (*destroy)(shark_object *), bool is_object_class);
 SHARK_API shark_function *shark_vm_bind_function(shark_vm *vm, shark_module *module, shark_class *type, char *name, size_t arity, shark_native_function code);
 SHARK_API void shark_vm_add_import_path(shark_vm *self, shark_string *import_path);
@@ -458,6 +768,8 @@ SHARK_API void shark_vm_exec_module(shark_vm *self, shark_module *module);
 SHARK_API shark_module *shark_vm_import_module(shark_vm *self, shark_string *name);
 SHARK_API shark_value shark_vm_execute(shark_vm *self, shark_vm_frame *prev, shark_module *module, shark_function *code);
 SHARK_API void shark_vm_exec_module(shark_vm *self, shark_module *module);
+SHARK_API void shark_vm_reconcile(shark_vm *self);
+SHARK_API size_t shark_vm_collect(shark_vm *self);
 SHARK_API shark_value shark_vm_exec_main(shark_vm *self, shark_module *module, shark_array *args);
 
 SHARK_API shark_int_t shark_get_err();
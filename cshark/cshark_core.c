@@ -30,6 +30,33 @@
 #include <stdlib.h>
 #include <string.h>
 
+#if defined(__unix__) || defined(__APPLE__)
+    #include <sys/mman.h>
+    #define SHARK_VM_STACK_MMAP
+    #ifndef SHARK_NO_ARCHIVE_MMAP
+        #include <sys/stat.h>
+        #define SHARK_ARCHIVE_MMAP
+    #endif
+    #if !defined(SHARK_NO_IMPORT_LISTING) && !defined(CSHARK_NO_FS)
+        #include <dirent.h>
+        #define SHARK_IMPORT_LISTING
+    #endif
+#elif defined(_WIN32)
+    #include <windows.h>
+    #ifdef BOOL
+        #undef BOOL
+    #endif
+    #ifdef CONST
+        #undef CONST
+    #endif
+    #define SHARK_VM_STACK_VIRTUAL
+#endif
+
+#if defined(SHARK_TABLE_SWISS) && (defined(__SSE2__) || defined(_M_X64))
+    #include <emmintrin.h>
+    #define SHARK_TABLE_SSE2
+#endif
+
 SHARK_API void shark_fatal_error(void *vm, char *message)
 {
     fprintf(stderr, "%s\n", message);
@@ -42,6 +69,98 @@ SHARK_API void shark_memory_error()
     shark_fatal_error(NULL, "memory allocation failure.");
 }
 
+#ifndef SHARK_NO_POOL
+
+/* The pools are shared by every vm in the process, like the zero count table,
+** and chunks are kept for reuse instead of given back. */
+static size_t *shark_pool_free_list[SHARK_POOL_CLASSES];
+static uint8_t *shark_pool_top = NULL;
+static uint8_t *shark_pool_end = NULL;
+
+#define SHARK_POOL_LARGE    SHARK_POOL_CLASSES
+
+static void *shark_pool_alloc(size_t size)
+{
+    size_t *block;
+    size_t index = (size + sizeof(size_t) - 1) / SHARK_POOL_GRANULE;
+    if (index >= SHARK_POOL_CLASSES) {
+        block = malloc(sizeof(size_t) + size);
+        if (block == NULL) shark_memory_error();
+        *block = SHARK_POOL_LARGE;
+        return block + 1;
+    }
+    block = shark_pool_free_list[index];
+    if (block != NULL) {
+        shark_pool_free_list[index] = (size_t *) *block;
+    } else {
+        size_t block_size = (index + 1) * SHARK_POOL_GRANULE;
+        if (shark_pool_top + block_size > shark_pool_end) {
+            shark_pool_top = malloc(SHARK_POOL_CHUNK_SIZE);
+            if (shark_pool_top == NULL) shark_memory_error();
+            shark_pool_end = shark_pool_top + SHARK_POOL_CHUNK_SIZE;
+        }
+        block = (size_t *) shark_pool_top;
+        shark_pool_top += block_size;
+    }
+    *block = index;
+    return block + 1;
+}
+
+SHARK_API void *shark_malloc(size_t object_size)
+{
+    return shark_pool_alloc(object_size);
+}
+
+SHARK_API void *shark_realloc(void *object, size_t new_size)
+{
+    if (object == NULL) return shark_pool_alloc(new_size);
+    size_t *block = (size_t *) object - 1;
+    if (*block == SHARK_POOL_LARGE && new_size > SHARK_POOL_MAX_SIZE) {
+        block = realloc(block, sizeof(size_t) + new_size);
+        if (block == NULL) shark_memory_error();
+        return block + 1;
+    }
+    size_t old_size = *block == SHARK_POOL_LARGE ? new_size
+        : (*block + 1) * SHARK_POOL_GRANULE - sizeof(size_t);
+    if (*block != SHARK_POOL_LARGE && new_size <= old_size)
+        return object;
+    void *new_object = shark_pool_alloc(new_size);
+    memcpy(new_object, object, old_size < new_size ? old_size : new_size);
+    shark_free(object);
+    return new_object;
+}
+
+SHARK_API void *shark_calloc(size_t count, size_t object_size)
+{
+    if (object_size != 0 && count > SIZE_MAX / object_size) shark_memory_error();
+    size_t size = count * object_size;
+    if (size > SHARK_POOL_MAX_SIZE) {
+        /* calloc can hand out fresh pages that are zero already */
+        size_t *block = calloc(1, sizeof(size_t) + size);
+        if (block == NULL) shark_memory_error();
+        *block = SHARK_POOL_LARGE;
+        return block + 1;
+    }
+    void *object = shark_pool_alloc(size);
+    memset(object, 0, size);
+    return object;
+}
+
+SHARK_API void shark_free(void *object)
+{
+    if (object == NULL) return;
+    size_t *block = (size_t *) object - 1;
+    size_t index = *block;
+    if (index == SHARK_POOL_LARGE) {
+        free(block);
+    } else {
+        *block = (size_t) shark_pool_free_list[index];
+        shark_pool_free_list[index] = block;
+    }
+}
+
+#else
+
 SHARK_API void *shark_malloc(size_t object_size)
 {
 	void *object = malloc(object_size);
@@ -63,6 +182,13 @@ SHARK_API void *shark_calloc(size_t count, size_t object_size)
     return object;
 }
 
+SHARK_API void shark_free(void *object)
+{
+    free(object);
+}
+
+#endif
+
 SHARK_API void *shark_object_new(shark_class *type)
 {
     shark_object *self = shark_zalloc(type->object_size);
@@ -89,10 +215,49 @@ SHARK_API void *shark_object_inc_ref(void *self)
     return self;
 }
 
+static shark_object **shark_zct = NULL;
+static size_t shark_zct_count = 0;
+static size_t shark_zct_size = 0;
+static size_t shark_zct_limit = SHARK_ZCT_INIT_SIZE;
+
+static void shark_zct_add(shark_object *object)
+{
+    if (shark_zct_count == shark_zct_size) {
+        shark_zct_size = shark_zct_size == 0 ? SHARK_ZCT_INIT_SIZE : shark_zct_size << 1;
+        shark_zct = shark_realloc(shark_zct, shark_zct_size * sizeof(shark_object *));
+    }
+    shark_zct[shark_zct_count++] = object;
+}
+
+static shark_object **shark_gc_roots = NULL;
+static size_t shark_gc_count = 0;
+static size_t shark_gc_size = 0;
+static size_t shark_gc_limit = SHARK_GC_THRESHOLD;
+static shark_gc_stats shark_gc = { SHARK_GC_THRESHOLD, 0, 0, 0 };
+
+static void shark_gc_add(shark_object *object)
+{
+    if (shark_gc_count == shark_gc_size) {
+        shark_gc_size = shark_gc_size == 0 ? SHARK_GC_THRESHOLD : shark_gc_size << 1;
+        shark_gc_roots = shark_realloc(shark_gc_roots, shark_gc_size * sizeof(shark_object *));
+    }
+    shark_gc_roots[shark_gc_count++] = object;
+}
+
 SHARK_API void shark_object_dec_ref(void *self)
 {
     shark_object *object = self;
-    if (self != NULL && !(--object->ref_count)) shark_object_delete(object);
+    if (self == NULL) return;
+    size_t count = --object->ref_count;
+    if (!(count & SHARK_REF_COUNT_MASK)) {
+        if (!(count & SHARK_ZCT_FLAG)) {
+            object->ref_count = count | SHARK_ZCT_FLAG;
+            shark_zct_add(object);
+        }
+    } else if (!(count & SHARK_GC_BUFFERED) && object->type->traverse != NULL) {
+        object->ref_count = count | SHARK_GC_BUFFERED;
+        shark_gc_add(object);
+    }
 }
 
 SHARK_API bool shark_object_instanceof(shark_object *self, shark_class *type)
@@ -152,23 +317,165 @@ SHARK_API shark_bool_t shark_object_is_class(shark_object *object)
     return object->type == &shark_class_class;
 }
 
+/* wyhash (final version 3, default secret): reads 8 bytes at a time and
+** mixes with the folded 128 bit product of two words. */
+static void shark_hash_mum(uint64_t *a, uint64_t *b)
+{
+#ifdef __SIZEOF_INT128__
+    __uint128_t r = (__uint128_t) *a * *b;
+    *a = (uint64_t) r;
+    *b = (uint64_t) (r >> 64);
+#else
+    uint64_t ha = *a >> 32, hb = *b >> 32, la = (uint32_t) *a, lb = (uint32_t) *b;
+    uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+    uint64_t t = rl + (rm0 << 32), c = t < rl;
+    uint64_t lo = t + (rm1 << 32);
+    c += lo < t;
+    *a = lo;
+    *b = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+#endif
+}
+
+static uint64_t shark_hash_mix(uint64_t a, uint64_t b)
+{
+    shark_hash_mum(&a, &b);
+    return a ^ b;
+}
+
+static uint64_t shark_hash_read8(uint8_t *data)
+{
+    uint64_t value;
+    memcpy(&value, data, 8);
+    return value;
+}
+
+static uint64_t shark_hash_read4(uint8_t *data)
+{
+    uint32_t value;
+    memcpy(&value, data, 4);
+    return value;
+}
+
+#define SHARK_HASH_S0   0xa0761d6478bd642full
+#define SHARK_HASH_S1   0xe7037ed1a0b428dbull
+#define SHARK_HASH_S2   0x8ebc6af09c88c6e3ull
+#define SHARK_HASH_S3   0x589965cc75374cc3ull
+
+/* Never 0, that's what an unhashed string holds. */
 SHARK_API size_t shark_hash_byte_str(size_t length, uint8_t *data)
 {
-    size_t hash = 5381;
-    for (size_t i = 0; i < length; i++) {
-        hash = ((hash << 5) + hash + *(data++)) & 4294967295;
+    uint64_t seed = shark_hash_mix(SHARK_HASH_S0, SHARK_HASH_S1);
+    uint64_t a, b;
+    if (length <= 16) {
+        if (length >= 4) {
+            size_t step = (length >> 3) << 2;
+            a = (shark_hash_read4(data) << 32) | shark_hash_read4(data + step);
+            b = (shark_hash_read4(data + length - 4) << 32) | shark_hash_read4(data + length - 4 - step);
+        } else if (length > 0) {
+            a = (((uint64_t) data[0]) << 16) | (((uint64_t) data[length >> 1]) << 8) | data[length - 1];
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        size_t i = length;
+        if (i > 48) {
+            uint64_t see1 = seed, see2 = seed;
+            do {
+                seed = shark_hash_mix(shark_hash_read8(data) ^ SHARK_HASH_S1, shark_hash_read8(data + 8) ^ seed);
+                see1 = shark_hash_mix(shark_hash_read8(data + 16) ^ SHARK_HASH_S2, shark_hash_read8(data + 24) ^ see1);
+                see2 = shark_hash_mix(shark_hash_read8(data + 32) ^ SHARK_HASH_S3, shark_hash_read8(data + 40) ^ see2);
+                data += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= see1 ^ see2;
+        }
+        while (i > 16) {
+            seed = shark_hash_mix(shark_hash_read8(data) ^ SHARK_HASH_S1, shark_hash_read8(data + 8) ^ seed);
+            data += 16;
+            i -= 16;
+        }
+        a = shark_hash_read8(data + i - 16);
+        b = shark_hash_read8(data + i - 8);
     }
-    return hash;
+    a ^= SHARK_HASH_S1;
+    b ^= seed;
+    shark_hash_mum(&a, &b);
+    uint64_t hash = shark_hash_mix(a ^ SHARK_HASH_S0 ^ length, b ^ SHARK_HASH_S1);
+    return hash == 0 ? 1 : (size_t) hash;
 }
 
+#undef SHARK_HASH_S0
+#undef SHARK_HASH_S1
+#undef SHARK_HASH_S2
+#undef SHARK_HASH_S3
+
+/* Only marks the string as unhashed, the hash is computed the first time
+** it's needed (see shark_string_hash) so strings never used as keys or
+** compared are never hashed. */
 SHARK_API void shark_string_init(shark_string *self)
 {
-    self->hash = shark_hash_byte_str(self->size, self->data);
+    self->hash = 0;
+}
+
+SHARK_API size_t shark_string_hash(shark_string *self)
+{
+    if (self->hash == 0)
+        self->hash = shark_hash_byte_str(self->size, self->data);
+    return self->hash;
 }
 
-static void shark_string_destroy(shark_object *self)
+static shark_string **shark_intern_set = NULL;
+static size_t shark_intern_count = 0;
+static size_t shark_intern_mask = 0;
+
+static size_t shark_intern_slot(size_t size, uint8_t *data, size_t hash)
+{
+    size_t slot = hash & shark_intern_mask;
+    while (true) {
+        shark_string *entry = shark_intern_set[slot];
+        if (entry == NULL || (entry->hash == hash && entry->size == size
+            && memcmp(entry->data, data, size) == 0))
+            return slot;
+        slot = (slot + 1) & shark_intern_mask;
+    }
+}
+
+static void shark_intern_grow()
+{
+    shark_string **old_set = shark_intern_set;
+    size_t old_size = old_set == NULL ? 0 : shark_intern_mask + 1;
+    size_t size = old_set == NULL ? SHARK_INTERN_INIT_SIZE : old_size << 1;
+    shark_intern_set = shark_zalloc(size * sizeof(shark_string *));
+    shark_intern_mask = size - 1;
+    for (size_t i = 0; i < old_size; i++) {
+        shark_string *entry = old_set[i];
+        if (entry != NULL)
+            shark_intern_set[shark_intern_slot(entry->size, entry->data, entry->hash)] = entry;
+    }
+    shark_free(old_set);
+}
+
+/* Removes an interned string from the table, the entries after it in the
+** same run are shifted back so lookups never stop early. */
+static void shark_string_destroy(shark_object *object)
 {
-    shark_free(((shark_string *) self)->data);
+    if (!(object->ref_count & SHARK_STRING_INTERNED)) return;
+    shark_string *self = (shark_string *) object;
+    size_t slot = self->hash & shark_intern_mask;
+    while (shark_intern_set[slot] != self)
+        slot = (slot + 1) & shark_intern_mask;
+    size_t next = (slot + 1) & shark_intern_mask;
+    while (shark_intern_set[next] != NULL) {
+        size_t home = shark_intern_set[next]->hash & shark_intern_mask;
+        if (((next - home) & shark_intern_mask) >= ((next - slot) & shark_intern_mask)) {
+            shark_intern_set[slot] = shark_intern_set[next];
+            slot = next;
+        }
+        next = (next + 1) & shark_intern_mask;
+    }
+    shark_intern_set[slot] = NULL;
+    shark_intern_count--;
 }
 
 static shark_class shark_string_class = {
@@ -182,42 +489,79 @@ static shark_class shark_string_class = {
     NULL
 };
 
-SHARK_API void *shark_string_new_with_size(size_t size)
+/* The bytes follow the header in the same block, object_size of the class
+** only covers the header. */
+static shark_string *shark_string_alloc(size_t size)
 {
-    shark_string *self = shark_object_new(&shark_string_class);
+    shark_string *self = shark_malloc(sizeof(shark_string) + size + 1);
+    self->super.type = &shark_string_class;
+    self->super.ref_count = 1;
     self->size = size;
-    self->data = shark_malloc(size + 1);
+    self->hash = 0;
     self->data[size] = '\0';
     return self;
 }
 
+SHARK_API void *shark_string_new_with_size(size_t size)
+{
+    return shark_string_alloc(size);
+}
+
 SHARK_API void *shark_string_new_from_byte_str(size_t size, uint8_t *data)
 {
-    shark_string *self = shark_object_new(&shark_string_class);
-    self->size = size;
-    self->data = shark_malloc(size + 1);
+    shark_string *self = shark_string_alloc(size);
     memcpy(self->data, data, size);
-    self->data[size] = '\0';
     shark_string_init(self);
 	return self;
 }
 
 SHARK_API void *shark_string_new_from_cstr(char *data)
 {
-    shark_string *self = shark_object_new(&shark_string_class);
     size_t size = strlen(data);
-    self->size = size;
-    self->data = shark_malloc(size + 1);
+    shark_string *self = shark_string_alloc(size);
     memcpy(self->data, data, size);
-    self->data[size] = '\0';
     shark_string_init(self);
     return self;
 }
 
+SHARK_API shark_string *shark_string_resize(shark_string *self, size_t size)
+{
+    self = shark_realloc(self, sizeof(shark_string) + size + 1);
+    self->size = size;
+    self->data[size] = '\0';
+    return self;
+}
+
+SHARK_API shark_string *shark_string_intern(shark_string *self)
+{
+    if (self->super.ref_count & SHARK_STRING_INTERNED) return self;
+    if (shark_intern_set == NULL || shark_intern_count * 2 >= shark_intern_mask)
+        shark_intern_grow();
+    size_t slot = shark_intern_slot(self->size, self->data, shark_string_hash(self));
+    shark_string *entry = shark_intern_set[slot];
+    if (entry != NULL) {
+        shark_object_inc_ref(entry);
+        shark_object_dec_ref(self);
+        return entry;
+    }
+    self->super.ref_count |= SHARK_STRING_INTERNED;
+    shark_intern_set[slot] = self;
+    shark_intern_count++;
+    return self;
+}
+
+/* Returns the interned string with these bytes (no new reference) or NULL. */
+SHARK_API shark_string *shark_string_find_interned(size_t size, uint8_t *data)
+{
+    if (shark_intern_set == NULL) return NULL;
+    return shark_intern_set[shark_intern_slot(size, data, shark_hash_byte_str(size, data))];
+}
+
 SHARK_API bool shark_string_equals(shark_string *self, shark_string *other)
 {
     if (self == other) return true;
-    if (self->hash != other->hash) return false;
+    if (self->super.ref_count & other->super.ref_count & SHARK_STRING_INTERNED) return false;
+    if (self->hash != 0 && other->hash != 0 && self->hash != other->hash) return false;
     if (self->size != other->size) return false;
     return memcmp(self->data, other->data, self->size) == 0;
 }
@@ -225,9 +569,18 @@ SHARK_API bool shark_string_equals(shark_string *self, shark_string *other)
 static void shark_array_destroy(shark_object *object)
 {
     shark_array *self = (shark_array *) object;
+    if (self->kind == SHARK_ARRAY_GENERIC)
+        for (size_t i = 0; i < self->length; i++)
+            shark_value_dec_ref(self->data[i]);
+    shark_free(self->data - self->head);
+}
+
+static void shark_array_traverse(shark_object *object, void (*visit)(shark_object *))
+{
+    shark_array *self = (shark_array *) object;
+    if (self->kind == SHARK_ARRAY_NUMERIC) return;
     for (size_t i = 0; i < self->length; i++)
-        shark_value_dec_ref(self->data[i]);
-    shark_free(self->data);
+        if (SHARK_IS_OBJECT(self->data[i])) visit(SHARK_AS_OBJECT(self->data[i]));
 }
 
 static shark_class shark_array_class = {
@@ -238,14 +591,18 @@ static shark_class shark_array_class = {
     sizeof(shark_array),
     shark_array_destroy,
     false,
-    NULL
+    NULL,
+    NULL,
+    shark_array_traverse
 };
 
 SHARK_API void *shark_array_new()
 {
     shark_array *self = shark_object_new(&shark_array_class);
+    self->kind = SHARK_ARRAY_NUMERIC;
     self->length = 0;
     self->size = SHARK_ARRAY_INIT_SIZE;
+    self->head = 0;
     self->data = shark_malloc(sizeof(shark_value) * SHARK_ARRAY_INIT_SIZE);
     return self;
 }
@@ -258,29 +615,128 @@ SHARK_API void shark_array_preallocate(shark_array *self, size_t size)
     if (new_size <= self->size) return;
 
     self->size = new_size;
-    self->data = shark_realloc(self->data, sizeof(shark_value) * new_size);
+    self->data = (shark_value *) shark_realloc(self->data - self->head,
+        sizeof(shark_value) * (self->head + new_size)) + self->head;
+}
+
+/* Moves the elements down to the start of the buffer. */
+static void shark_array_drop_head(shark_array *self)
+{
+    shark_value *base = self->data - self->head;
+    memmove(base, self->data, sizeof(shark_value) * self->length);
+    self->data = base;
+    self->size += self->head;
+    self->head = 0;
 }
 
 SHARK_API void shark_array_grow(shark_array *self)
 {
     if (self->length >= self->size)
     {
+        /* a queue leaves as much room at the front as it fills at the back,
+        ** reusing it keeps the buffer from growing without bound. */
+        if (self->head >= self->length) {
+            shark_array_drop_head(self);
+            return;
+        }
         self->size = SHARK_ARRAY_GROW_SIZE(self->size);
-        self->data = shark_realloc(self->data, sizeof(shark_value) * self->size);
+        self->data = (shark_value *) shark_realloc(self->data - self->head,
+            sizeof(shark_value) * (self->head + self->size)) + self->head;
     }
 }
 
 SHARK_API void shark_array_put(shark_array *self, shark_value value)
 {
-    self->data[self->length++] = shark_value_inc_ref(value);
+    if (SHARK_IS_OBJECT(value)) {
+        self->kind = SHARK_ARRAY_GENERIC;
+        shark_object_inc_ref(SHARK_AS_OBJECT(value));
+    }
+    self->data[self->length++] = value;
+    shark_array_grow(self);
+}
+
+/* Replaces the element at 'index', which must be in range. */
+SHARK_API void shark_array_set(shark_array *self, size_t index, shark_value value)
+{
+    if (SHARK_IS_OBJECT(value)) {
+        self->kind = SHARK_ARRAY_GENERIC;
+        shark_object_inc_ref(SHARK_AS_OBJECT(value));
+    }
+    if (self->kind == SHARK_ARRAY_GENERIC)
+        shark_value_dec_ref(self->data[index]);
+    self->data[index] = value;
+}
+
+/* Makes room for at least as many elements before the first one as there
+** are elements, so a run of insertions at the front copies them all just
+** once in a while. */
+static void shark_array_grow_head(shark_array *self)
+{
+    size_t head = self->length > SHARK_ARRAY_INIT_SIZE ? self->length : SHARK_ARRAY_INIT_SIZE;
+    shark_value *base = shark_malloc(sizeof(shark_value) * (head + self->size));
+    memcpy(base + head, self->data, sizeof(shark_value) * self->length);
+    shark_free(self->data - self->head);
+    self->data = base + head;
+    self->head = head;
+}
+
+/* Elements before 'index' move to the front and the ones after it to the
+** back, whichever are fewer. */
+SHARK_API void shark_array_insert(shark_array *self, size_t index, shark_value value)
+{
+    if (index < self->length / 2) {
+        if (self->head == 0) shark_array_grow_head(self);
+        self->data--;
+        self->head--;
+        self->size++;
+        memmove(self->data, self->data + 1, sizeof(shark_value) * index);
+    } else {
+        memmove(self->data + index + 1, self->data + index, sizeof(shark_value) * (self->length - index));
+    }
+    if (SHARK_IS_OBJECT(value)) {
+        self->kind = SHARK_ARRAY_GENERIC;
+        shark_object_inc_ref(SHARK_AS_OBJECT(value));
+    }
+    self->data[index] = value;
+    self->length++;
     shark_array_grow(self);
 }
 
+/* Takes out the element at 'index' and hands its reference to the caller. */
+SHARK_API shark_value shark_array_remove(shark_array *self, size_t index)
+{
+    shark_value value = self->data[index];
+    if (index < self->length / 2) {
+        memmove(self->data + 1, self->data, sizeof(shark_value) * index);
+        self->data++;
+        self->head++;
+        self->size--;
+    } else {
+        memmove(self->data + index, self->data + index + 1, sizeof(shark_value) * (self->length - index - 1));
+    }
+    self->length--;
+    shark_array_shrink(self);
+    return value;
+}
+
+/* Copies 'count' elements of 'source' from 'start' on into 'self' at
+** 'index', over slots that hold no references (room must be there). */
+SHARK_API void shark_array_fill(shark_array *self, size_t index, shark_array *source, size_t start, size_t count)
+{
+    memcpy(self->data + index, source->data + start, sizeof(shark_value) * count);
+    if (source->kind == SHARK_ARRAY_NUMERIC) return;
+    self->kind = SHARK_ARRAY_GENERIC;
+    for (size_t i = 0; i < count; i++)
+        shark_value_inc_ref(source->data[start + i]);
+}
+
 SHARK_API void shark_array_shrink(shark_array *self)
 {
-    if (self->length <= self->size >> 2 && self->size >= 16)
+    size_t total = self->head + self->size;
+    if (self->length <= total >> 2 && total >= 16)
     {
-        self->size = SHARK_ARRAY_SHRINK_SIZE(self->size);
+        shark_array_drop_head(self);
+        self->size = SHARK_ARRAY_SHRINK_SIZE(total);
         self->data = shark_realloc(self->data, sizeof(shark_value) * self->size);
     }
 }
@@ -294,16 +750,73 @@ SHARK_API shark_value shark_array_pop(shark_array *self)
     return value;
 }
 
+/* one past the last slot worth walking */
+#ifdef SHARK_TABLE_COMPACT
+    #define SHARK_TABLE_END(table)      ((table)->used)
+#else
+    #define SHARK_TABLE_END(table)      ((table)->size)
+#endif
+
 static void shark_table_destroy(shark_object *object)
 {
     shark_table *self = (shark_table *) object;
-    for (size_t i = 0; i < self->size; i++) {
+    if (self->shape != NULL) {
+        for (size_t i = 0; i < self->count; i++)
+            shark_value_dec_ref(self->fields[i]);
+        shark_free(self->fields);
+        shark_object_dec_ref(self->shape);
+        return;
+    }
+    for (size_t i = 0; i < SHARK_TABLE_END(self); i++) {
         if (self->data[i].hash != SHARK_TABLE_HASH_NULL) {
             shark_value_dec_ref(self->data[i].key);
             shark_value_dec_ref(self->data[i].value);
         }
     }
     shark_free(self->data);
+#if defined(SHARK_TABLE_SWISS)
+    shark_free(self->ctrl);
+#elif defined(SHARK_TABLE_COMPACT)
+    shark_free(self->index);
+#endif
+#ifdef SHARK_TABLE_INCREMENTAL
+    if (self->old_data != NULL) {
+        for (size_t i = self->migrated; i < self->old_size; i++) {
+            if (self->old_data[i].hash != SHARK_TABLE_HASH_NULL) {
+                shark_value_dec_ref(self->old_data[i].key);
+                shark_value_dec_ref(self->old_data[i].value);
+            }
+        }
+        shark_free(self->old_data);
+    }
+#endif
+}
+
+static void shark_table_traverse(shark_object *object, void (*visit)(shark_object *))
+{
+    shark_table *self = (shark_table *) object;
+    if (self->shape != NULL) {
+        for (size_t i = 0; i < self->count; i++)
+            if (SHARK_IS_OBJECT(self->fields[i])) visit(SHARK_AS_OBJECT(self->fields[i]));
+        visit((shark_object *) self->shape);
+        return;
+    }
+    for (size_t i = 0; i < SHARK_TABLE_END(self); i++) {
+        if (self->data[i].hash != SHARK_TABLE_HASH_NULL) {
+            if (SHARK_IS_OBJECT(self->data[i].key)) visit(SHARK_AS_OBJECT(self->data[i].key));
+            if (SHARK_IS_OBJECT(self->data[i].value)) visit(SHARK_AS_OBJECT(self->data[i].value));
+        }
+    }
+#ifdef SHARK_TABLE_INCREMENTAL
+    if (self->old_data != NULL) {
+        for (size_t i = self->migrated; i < self->old_size; i++) {
+            if (self->old_data[i].hash != SHARK_TABLE_HASH_NULL) {
+                if (SHARK_IS_OBJECT(self->old_data[i].key)) visit(SHARK_AS_OBJECT(self->old_data[i].key));
+                if (SHARK_IS_OBJECT(self->old_data[i].value)) visit(SHARK_AS_OBJECT(self->old_data[i].value));
+            }
+        }
+    }
+#endif
 }
 
 static shark_class shark_table_class = {
@@ -314,98 +827,418 @@ static shark_class shark_table_class = {
     sizeof(shark_table),
     shark_table_destroy,
     false,
-    NULL
+    NULL,
+    NULL,
+    shark_table_traverse
 };
 
-static void shark_table_init(shark_table *self)
+#ifdef SHARK_TABLE_SWISS
+
+/* Control bytes: a full slot holds the low 7 bits of its (mixed) hash, so it
+** never has the top bit set. Tables smaller than a group pad the control
+** array to a whole group with sentinels, which match nothing. */
+#define SHARK_TABLE_CTRL_EMPTY      ((uint8_t) 0x80)
+#define SHARK_TABLE_CTRL_DELETED    ((uint8_t) 0xFE)
+#define SHARK_TABLE_CTRL_SENTINEL   ((uint8_t) 0xFF)
+
+#define SHARK_TABLE_CTRL_SIZE(size) ((size) < SHARK_TABLE_GROUP_SIZE ? SHARK_TABLE_GROUP_SIZE : (size))
+#define SHARK_TABLE_MAX_LOAD(size)  ((size) * 7 / 8)
+
+/* value hashes of numbers are their bits, so they are spread out before the
+** tag and group are taken from them. */
+static size_t shark_table_mix(size_t hash)
 {
-    self->count = 0;
-    self->size = SHARK_TABLE_INIT_SIZE;
-    self->mask = SHARK_TABLE_INIT_SIZE - 1;
-    self->data = shark_zalloc(sizeof(shark_table_slot) * SHARK_TABLE_INIT_SIZE);
+    uint64_t h = (uint64_t) hash * 0x9E3779B97F4A7C15ull;
+    return (size_t) (h ^ (h >> 32));
 }
 
-SHARK_API shark_table *shark_table_new()
+static unsigned shark_table_group_match(uint8_t *group, uint8_t tag)
 {
-    shark_table *self = shark_object_new(&shark_table_class);
-    shark_table_init(self);
-    return self;
+#ifdef SHARK_TABLE_SSE2
+    __m128i ctrl = _mm_loadu_si128((__m128i *) group);
+    return (unsigned) _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8((char) tag)));
+#else
+    unsigned bits = 0;
+    for (unsigned i = 0; i < SHARK_TABLE_GROUP_SIZE; i++)
+        if (group[i] == tag) bits |= 1u << i;
+    return bits;
+#endif
 }
 
-SHARK_API shark_table *shark_table_copy(shark_table *self)
+/* empty or deleted slots, the ones an insertion may take. */
+static unsigned shark_table_group_match_free(uint8_t *group)
 {
-    shark_table *copy = shark_object_new(&shark_table_class);
-    copy->count = self->count;
-    copy->size = self->size;
-    copy->mask = self->mask;
-    size_t data_size = sizeof(shark_table_slot) * self->size;
-    copy->data = shark_malloc(data_size);
-    memcpy(copy->data, self->data, data_size);
-    for (size_t i = 0; i < copy->size; i++) {
-        if (copy->data[i].hash != SHARK_TABLE_HASH_NULL) {
-            shark_value_inc_ref(copy->data[i].key);
-            shark_value_inc_ref(copy->data[i].value);
-        }
-    }
-    return copy;
+#ifdef SHARK_TABLE_SSE2
+    __m128i ctrl = _mm_loadu_si128((__m128i *) group);
+    return (unsigned) _mm_movemask_epi8(_mm_cmpgt_epi8(_mm_set1_epi8((char) SHARK_TABLE_CTRL_SENTINEL), ctrl));
+#else
+    unsigned bits = 0;
+    for (unsigned i = 0; i < SHARK_TABLE_GROUP_SIZE; i++)
+        if (group[i] == SHARK_TABLE_CTRL_EMPTY || group[i] == SHARK_TABLE_CTRL_DELETED)
+            bits |= 1u << i;
+    return bits;
+#endif
 }
 
-static size_t find_closest_shift(size_t n)
+static unsigned shark_table_first_bit(unsigned bits)
 {
-    size_t i;
-    for (i = 0; n; i++) n >>= 1;
+#if defined(__GNUC__) || defined(__clang__)
+    return (unsigned) __builtin_ctz(bits);
+#else
+    unsigned i = 0;
+    while ((bits & 1) == 0) { bits >>= 1; i++; }
     return i;
+#endif
 }
 
-static void shark_table_set_closest_size(shark_table *self, size_t size)
+/* Entries go to their home position within the group when it's free, so a
+** lookup can start loading the slot while it matches the control bytes. */
+static size_t shark_table_pick_free(unsigned bits, size_t home)
 {
-    if (size < SHARK_TABLE_INIT_SIZE) size = SHARK_TABLE_INIT_SIZE;
-    self->size = 1 << find_closest_shift(size);
-    self->mask = self->size - 1;
+    if (bits & (1u << home)) return home;
+    return shark_table_first_bit(bits);
 }
 
-SHARK_API size_t shark_value_hash(shark_value x)
+static void shark_table_ctrl_init(shark_table *self)
 {
-#ifdef SHARK_UNBOX
-    switch (x.type)
+    size_t ctrl_size = SHARK_TABLE_CTRL_SIZE(self->size);
+    self->ctrl = shark_malloc(ctrl_size);
+    memset(self->ctrl, SHARK_TABLE_CTRL_EMPTY, self->size);
+    memset(self->ctrl + self->size, SHARK_TABLE_CTRL_SENTINEL, ctrl_size - self->size);
+    self->growth = SHARK_TABLE_MAX_LOAD(self->size) - self->count;
+}
+
+/* Groups are probed in triangular steps, which visits every group when
+** their number is a power of two. Empty slots end the probe sequence. */
+static size_t shark_table_find_free(shark_table *self, size_t hash)
+{
+    size_t mixed = shark_table_mix(hash);
+    size_t home = mixed & self->mask & (SHARK_TABLE_GROUP_SIZE - 1);
+    size_t mask = self->mask / SHARK_TABLE_GROUP_SIZE;
+    size_t group = (mixed >> 7) & mask;
+    size_t step = 0;
+    unsigned bits;
+    while ((bits = shark_table_group_match_free(self->ctrl + group * SHARK_TABLE_GROUP_SIZE)) == 0)
     {
-        case SHARK_TYPE_VOID:
-            return 1;
-        case SHARK_TYPE_BOOL:
-            return SHARK_AS_BOOL(x) == true ? 2 : 1;
-        case SHARK_TYPE_NUM:
-            return (size_t) SHARK_AS_NUM(x);
-        case SHARK_TYPE_CHAR:
-            return (size_t) SHARK_AS_CHAR(x);
-        case SHARK_TYPE_OBJECT:
-            if (SHARK_AS_OBJECT(x)->type == &shark_string_class)
-                return SHARK_AS_STR(x)->hash;
-            return (size_t) SHARK_AS_OBJECT(x);
-        default:
-            shark_fatal_error(NULL, "unknown value type.");
+        step++;
+        group = (group + step) & mask;
     }
-#else
-    if (SHARK_IS_OBJECT(x) && SHARK_AS_OBJECT(x)->type == &shark_string_class)
-        return SHARK_AS_STR(x)->hash;
-    else
-        return ((size_t) x.INT) + 1;
-#endif
+    return group * SHARK_TABLE_GROUP_SIZE + shark_table_pick_free(bits, home);
 }
 
-SHARK_API bool shark_value_equals(shark_value x, shark_value y)
+#elif defined(SHARK_TABLE_COMPACT)
+
+/* Index slots hold the number of an entry, or one of these. */
+#define SHARK_TABLE_IX_EMPTY        (-1)
+#define SHARK_TABLE_IX_DUMMY        (-2)
+
+/* entries a table with 'size' index slots has room for. The entry after the
+** last one is always there and empty, so it can stand for a missing key. */
+#define SHARK_TABLE_USABLE(size)    ((size) * 3 / 4)
+
+static size_t shark_table_ix_width(size_t size)
 {
-#ifdef SHARK_UNBOX
-    if (x.type != y.type) return false;
-    switch (x.type)
-    {
-        case SHARK_TYPE_VOID:
-            return true;
-        case SHARK_TYPE_BOOL:
-            return SHARK_AS_BOOL(x) == SHARK_AS_BOOL(y);
-        case SHARK_TYPE_NUM:
-            return SHARK_AS_NUM(x) == SHARK_AS_NUM(y);
-        case SHARK_TYPE_CHAR:
-            return SHARK_AS_CHAR(x) == SHARK_AS_CHAR(y);
+    if (size <= 0x80) return 1;
+    if (size <= 0x8000) return 2;
+    if (size <= 0x80000000u) return 4;
+    return 8;
+}
+
+static ptrdiff_t shark_table_ix_get(shark_table *self, size_t i)
+{
+    if (self->size <= 0x80) return ((int8_t *) self->index)[i];
+    if (self->size <= 0x8000) return ((int16_t *) self->index)[i];
+    if (self->size <= 0x80000000u) return ((int32_t *) self->index)[i];
+    return (ptrdiff_t) ((int64_t *) self->index)[i];
+}
+
+static void shark_table_ix_set(shark_table *self, size_t i, ptrdiff_t ix)
+{
+    if (self->size <= 0x80) ((int8_t *) self->index)[i] = (int8_t) ix;
+    else if (self->size <= 0x8000) ((int16_t *) self->index)[i] = (int16_t) ix;
+    else if (self->size <= 0x80000000u) ((int32_t *) self->index)[i] = (int32_t) ix;
+    else ((int64_t *) self->index)[i] = (int64_t) ix;
+}
+
+static void shark_table_index_init(shark_table *self)
+{
+    size_t index_size = self->size * shark_table_ix_width(self->size);
+    self->index = shark_malloc(index_size);
+    memset(self->index, 0xFF, index_size);
+}
+
+/* Points the first free index slot on the probe sequence of 'hash' to
+** 'entry', for keys known to be missing from the table. 'filled' counts
+** the slots that aren't empty, dummies included, since lookups only stop
+** at an empty one. */
+static void shark_table_index_insert(shark_table *self, size_t hash, size_t entry)
+{
+    size_t mask = self->mask;
+    size_t i = hash & mask;
+    size_t step = 0;
+    ptrdiff_t ix;
+
+    while ((ix = shark_table_ix_get(self, i)) >= 0)
+    {
+        step++;
+        i += step;
+        i &= mask;
+    }
+
+    if (ix == SHARK_TABLE_IX_EMPTY) self->filled++;
+    shark_table_ix_set(self, i, (ptrdiff_t) entry);
+}
+
+static size_t shark_table_index_find(shark_table *self, size_t hash, size_t entry)
+{
+    size_t mask = self->mask;
+    size_t i = hash & mask;
+    size_t step = 0;
+
+    while (shark_table_ix_get(self, i) != (ptrdiff_t) entry)
+    {
+        step++;
+        i += step;
+        i &= mask;
+    }
+
+    return i;
+}
+
+
+#else
+
+/* Removing a key leaves a tombstone behind (no hash, but a key that isn't
+** null) so the keys that were probed past it stay reachable. Insertions
+** reuse tombstones and rebuilds drop them. */
+#define SHARK_TABLE_TOMBSTONE           SHARK_TRUE
+#define SHARK_TABLE_IS_TOMBSTONE(slot)  ((slot).hash == SHARK_TABLE_HASH_NULL && !SHARK_IS_NULL((slot).key))
+
+static void shark_table_bury(shark_table_slot *slot)
+{
+    memset(slot, 0, sizeof(shark_table_slot));
+    slot->key = SHARK_TABLE_TOMBSTONE;
+}
+
+/* Moves a slot into the first free slot of its probe sequence, for keys
+** known to be missing from the table. */
+static void shark_table_place(shark_table *self, shark_table_slot *slot)
+{
+    size_t mask = self->mask;
+    size_t slot_index = slot->hash & mask;
+    size_t step = 0;
+
+    while (self->data[slot_index].hash != SHARK_TABLE_HASH_NULL)
+    {
+        step++;
+        slot_index += step;
+        slot_index &= mask;
+    }
+
+    if (SHARK_TABLE_IS_TOMBSTONE(self->data[slot_index])) self->deleted--;
+    self->data[slot_index] = *slot;
+}
+
+#endif
+
+#ifdef SHARK_TABLE_INCREMENTAL
+
+/* Moves up to 'steps' slots of the old array into the new one; the slots
+** moved become tombstones so a probe of the old array can't find them. */
+static void shark_table_rehash_step(shark_table *self, size_t steps)
+{
+    size_t end = self->migrated + steps;
+    if (end > self->old_size) end = self->old_size;
+
+    for (size_t i = self->migrated; i < end; i++)
+    {
+        if (self->old_data[i].hash != SHARK_TABLE_HASH_NULL) {
+            shark_table_place(self, &self->old_data[i]);
+            shark_table_bury(&self->old_data[i]);
+        }
+    }
+
+    self->migrated = end;
+
+    if (end == self->old_size) {
+        shark_free(self->old_data);
+        self->old_data = NULL;
+    }
+}
+
+static void shark_table_finish_rehash(shark_table *self)
+{
+    if (self->old_data != NULL)
+        shark_table_rehash_step(self, self->old_size);
+}
+
+#else
+    #define shark_table_finish_rehash(self)
+#endif
+
+static void shark_table_init(shark_table *self)
+{
+    self->count = 0;
+    self->size = SHARK_TABLE_INIT_SIZE;
+    self->mask = SHARK_TABLE_INIT_SIZE - 1;
+#if defined(SHARK_TABLE_SWISS)
+    self->data = shark_zalloc(sizeof(shark_table_slot) * SHARK_TABLE_INIT_SIZE);
+    shark_table_ctrl_init(self);
+#elif defined(SHARK_TABLE_COMPACT)
+    self->data = shark_zalloc(sizeof(shark_table_slot) * SHARK_TABLE_USABLE(SHARK_TABLE_INIT_SIZE));
+    shark_table_index_init(self);
+    self->used = 0;
+    self->filled = 0;
+#else
+    self->data = shark_zalloc(sizeof(shark_table_slot) * SHARK_TABLE_INIT_SIZE);
+    self->deleted = 0;
+#endif
+#ifdef SHARK_TABLE_INCREMENTAL
+    self->old_data = NULL;
+#endif
+    self->shape = NULL;
+    self->capacity = 0;
+    self->fields = NULL;
+}
+
+SHARK_API shark_table *shark_table_new()
+{
+    shark_table *self = shark_object_new(&shark_table_class);
+    shark_table_init(self);
+    return self;
+}
+
+SHARK_API shark_table *shark_table_new_shaped(shark_shape *shape)
+{
+    shark_table *self = shark_object_new(&shark_table_class);
+    self->count = shape->count;
+    self->size = 0;
+    self->mask = 0;
+    self->data = NULL;
+#if defined(SHARK_TABLE_SWISS)
+    self->ctrl = NULL;
+    self->growth = 0;
+#elif defined(SHARK_TABLE_COMPACT)
+    self->index = NULL;
+    self->used = 0;
+    self->filled = 0;
+#else
+    self->deleted = 0;
+#endif
+#ifdef SHARK_TABLE_INCREMENTAL
+    self->old_data = NULL;
+#endif
+    self->shape = shark_object_inc_ref(shape);
+    self->capacity = 0;
+    self->fields = NULL;
+    return self;
+}
+
+SHARK_API shark_table *shark_table_copy(shark_table *self)
+{
+    shark_table *copy = shark_object_new(&shark_table_class);
+    if (self->shape != NULL) {
+        copy->count = self->count;
+        copy->shape = shark_object_inc_ref(self->shape);
+        copy->capacity = self->capacity;
+        if (self->capacity != 0) {
+            copy->fields = shark_malloc(sizeof(shark_value) * self->capacity);
+            for (size_t i = 0; i < self->count; i++)
+                copy->fields[i] = shark_value_inc_ref(self->fields[i]);
+        }
+        return copy;
+    }
+    shark_table_finish_rehash(self);
+    copy->count = self->count;
+    copy->size = self->size;
+    copy->mask = self->mask;
+#ifdef SHARK_TABLE_COMPACT
+    /* entries past 'used' are all zero, only the live prefix is copied */
+    copy->data = shark_zalloc(sizeof(shark_table_slot) * SHARK_TABLE_USABLE(self->size));
+    memcpy(copy->data, self->data, sizeof(shark_table_slot) * self->used);
+    size_t index_size = self->size * shark_table_ix_width(self->size);
+    copy->index = shark_malloc(index_size);
+    memcpy(copy->index, self->index, index_size);
+    copy->used = self->used;
+    copy->filled = self->filled;
+#else
+    size_t data_size = sizeof(shark_table_slot) * self->size;
+    copy->data = shark_malloc(data_size);
+    memcpy(copy->data, self->data, data_size);
+#endif
+#if defined(SHARK_TABLE_SWISS)
+    copy->ctrl = shark_malloc(SHARK_TABLE_CTRL_SIZE(self->size));
+    memcpy(copy->ctrl, self->ctrl, SHARK_TABLE_CTRL_SIZE(self->size));
+    copy->growth = self->growth;
+#elif !defined(SHARK_TABLE_COMPACT)
+    copy->deleted = self->deleted;
+#endif
+    for (size_t i = 0; i < SHARK_TABLE_END(copy); i++) {
+        if (copy->data[i].hash != SHARK_TABLE_HASH_NULL) {
+            shark_value_inc_ref(copy->data[i].key);
+            shark_value_inc_ref(copy->data[i].value);
+        }
+    }
+    return copy;
+}
+
+static size_t find_closest_shift(size_t n)
+{
+    size_t i;
+    for (i = 0; n; i++) n >>= 1;
+    return i;
+}
+
+static void shark_table_set_closest_size(shark_table *self, size_t size)
+{
+    if (size < SHARK_TABLE_INIT_SIZE) size = SHARK_TABLE_INIT_SIZE;
+    self->size = 1 << find_closest_shift(size);
+    self->mask = self->size - 1;
+}
+
+SHARK_API size_t shark_value_hash(shark_value x)
+{
+#ifdef SHARK_UNBOX
+    switch (x.type)
+    {
+        case SHARK_TYPE_VOID:
+            return 1;
+        case SHARK_TYPE_BOOL:
+            return SHARK_AS_BOOL(x) == true ? 2 : 1;
+        case SHARK_TYPE_NUM:
+            return (size_t) SHARK_AS_NUM(x);
+        case SHARK_TYPE_CHAR:
+            return (size_t) SHARK_AS_CHAR(x);
+        case SHARK_TYPE_OBJECT:
+            if (SHARK_AS_OBJECT(x)->type == &shark_string_class)
+                return shark_string_hash(SHARK_AS_STR(x));
+            return (size_t) SHARK_AS_OBJECT(x);
+        default:
+            shark_fatal_error(NULL, "unknown value type.");
+    }
+#else
+    if (SHARK_IS_OBJECT(x) && SHARK_AS_OBJECT(x)->type == &shark_string_class)
+        return shark_string_hash(SHARK_AS_STR(x));
+    /* numbers (and pointers) differ in their high bits, fold them down */
+    uint64_t h = (uint64_t) x.INT * 0x9E3779B97F4A7C15ull;
+    return (size_t) (h ^ (h >> 32));
+#endif
+}
+
+SHARK_API bool shark_value_equals(shark_value x, shark_value y)
+{
+#ifdef SHARK_UNBOX
+    if (x.type != y.type) return false;
+    switch (x.type)
+    {
+        case SHARK_TYPE_VOID:
+            return true;
+        case SHARK_TYPE_BOOL:
+            return SHARK_AS_BOOL(x) == SHARK_AS_BOOL(y);
+        case SHARK_TYPE_NUM:
+            return SHARK_AS_NUM(x) == SHARK_AS_NUM(y);
+        case SHARK_TYPE_CHAR:
+            return SHARK_AS_CHAR(x) == SHARK_AS_CHAR(y);
         case SHARK_TYPE_OBJECT:
             if (SHARK_AS_OBJECT(x) == SHARK_AS_OBJECT(y)) return true;
             if (SHARK_AS_OBJECT(x)->type == &shark_string_class
@@ -429,88 +1262,309 @@ SHARK_API bool shark_value_equals(shark_value x, shark_value y)
 #endif
 }
 
+static bool shark_shape_lookup(shark_shape *self, shark_value key, size_t *index);
+static void shark_table_shaped_set(shark_table *self, shark_value key, shark_value value);
+static void shark_table_unshape(shark_table *self);
+
+#ifdef SHARK_TABLE_SWISS
+
+/* Returns the slot holding 'key' or, when it's missing, the first free slot
+** on its probe sequence (the one an insertion of 'key' should take). */
 static size_t shark_table_lookup_slot(shark_table *self, shark_value key, size_t *target_hash)
 {
-    size_t step = 0;
     size_t hash = shark_value_hash(key);
-    size_t mask = self->mask;
 
     if (hash == SHARK_TABLE_HASH_NULL)
         hash = SHARK_TABLE_HASH_NOT_NULL;
 
-    size_t slot_index = hash & mask;
-    size_t slot_hash = self->data[slot_index].hash;
+    if (target_hash != NULL) *target_hash = hash;
+
+    size_t mixed = shark_table_mix(hash);
+    uint8_t tag = mixed & 0x7F;
+    size_t home = mixed & self->mask & (SHARK_TABLE_GROUP_SIZE - 1);
+    size_t mask = self->mask / SHARK_TABLE_GROUP_SIZE;
+    size_t group = (mixed >> 7) & mask;
+    size_t step = 0;
+    size_t free_slot = (size_t) -1;
+
+    for (;;)
+    {
+        size_t base = group * SHARK_TABLE_GROUP_SIZE;
+        uint8_t *ctrl = self->ctrl + base;
+#if defined(__GNUC__) || defined(__clang__)
+        __builtin_prefetch(&self->data[base + home]);
+#endif
+        unsigned bits = shark_table_group_match(ctrl, tag);
+
+        while (bits != 0)
+        {
+            size_t slot_index = base + shark_table_first_bit(bits);
+            if (self->data[slot_index].hash == hash && shark_value_equals(self->data[slot_index].key, key))
+                return slot_index;
+            bits &= bits - 1;
+        }
+
+        if (free_slot == (size_t) -1 && (bits = shark_table_group_match_free(ctrl)) != 0)
+            free_slot = base + shark_table_pick_free(bits, home);
+
+        if (shark_table_group_match(ctrl, SHARK_TABLE_CTRL_EMPTY) != 0)
+            return free_slot;
+
+        step++;
+        group = (group + step) & mask;
+    }
+}
+
+#elif defined(SHARK_TABLE_COMPACT)
+
+/* Returns the entry holding 'key' or, when it's missing, the one past the
+** last entry (always empty, and where an insertion of 'key' goes). */
+static size_t shark_table_lookup_slot(shark_table *self, shark_value key, size_t *target_hash)
+{
+    size_t hash = shark_value_hash(key);
+
+    if (hash == SHARK_TABLE_HASH_NULL)
+        hash = SHARK_TABLE_HASH_NOT_NULL;
 
     if (target_hash != NULL) *target_hash = hash;
 
-    while (slot_hash != SHARK_TABLE_HASH_NULL)
+    size_t mask = self->mask;
+    size_t i = hash & mask;
+    size_t step = 0;
+
+    for (;;)
     {
-        if (slot_hash == hash && shark_value_equals(self->data[slot_index].key, key))
+        ptrdiff_t ix = shark_table_ix_get(self, i);
+        if (ix == SHARK_TABLE_IX_EMPTY)
+            return self->used;
+        if (ix >= 0 && self->data[ix].hash == hash && shark_value_equals(self->data[ix].key, key))
+            return (size_t) ix;
+        step++;
+        i += step;
+        i &= mask;
+    }
+}
+
+#else
+
+/* Returns the slot holding 'key' or, when it's missing, the first tombstone
+** on its probe sequence, or the empty slot ending it. */
+static size_t shark_table_probe(shark_table_slot *data, size_t mask, size_t hash, shark_value key)
+{
+    size_t step = 0;
+    size_t slot_index = hash & mask;
+    size_t free_slot = (size_t) -1;
+
+    for (;;)
+    {
+        size_t slot_hash = data[slot_index].hash;
+        if (slot_hash == hash && shark_value_equals(data[slot_index].key, key))
             return slot_index;
+        if (slot_hash == SHARK_TABLE_HASH_NULL) {
+            if (!SHARK_TABLE_IS_TOMBSTONE(data[slot_index]))
+                return free_slot != (size_t) -1 ? free_slot : slot_index;
+            if (free_slot == (size_t) -1)
+                free_slot = slot_index;
+        }
         step++;
         slot_index += step;
         slot_index &= mask;
-        slot_hash = self->data[slot_index].hash;
     }
+}
+
+static size_t shark_table_lookup_slot(shark_table *self, shark_value key, size_t *target_hash)
+{
+    size_t hash = shark_value_hash(key);
+
+    if (hash == SHARK_TABLE_HASH_NULL)
+        hash = SHARK_TABLE_HASH_NOT_NULL;
+
+    if (target_hash != NULL) *target_hash = hash;
+
+#ifdef SHARK_TABLE_INCREMENTAL
+    if (self->old_data != NULL)
+        shark_table_rehash_step(self, SHARK_TABLE_REHASH_STEP);
+#endif
+
+    size_t slot_index = shark_table_probe(self->data, self->mask, hash, key);
+
+#ifdef SHARK_TABLE_INCREMENTAL
+    /* a key still in the old array is moved over as soon as it's looked up. */
+    if (self->old_data != NULL && self->data[slot_index].hash == SHARK_TABLE_HASH_NULL)
+    {
+        shark_table_slot *old_slot = &self->old_data[shark_table_probe(self->old_data, self->old_size - 1, hash, key)];
+        if (old_slot->hash != SHARK_TABLE_HASH_NULL) {
+            if (SHARK_TABLE_IS_TOMBSTONE(self->data[slot_index])) self->deleted--;
+            self->data[slot_index] = *old_slot;
+            shark_table_bury(old_slot);
+        }
+    }
+#endif
 
     return slot_index;
 }
 
+#endif
+
 SHARK_API shark_value shark_table_get_index(shark_table *self, shark_value key)
 {
+    if (self->shape != NULL) {
+        size_t index;
+        if (shark_shape_lookup(self->shape, key, &index))
+            return self->fields[index];
+        return SHARK_NULL;
+    }
     size_t slot_index = shark_table_lookup_slot(self, key, NULL);
     return self->data[slot_index].value;
 }
 
 SHARK_API shark_value shark_table_get_str(shark_table *self, char *value)
 {
+    shark_string *interned = shark_string_find_interned(strlen(value), (uint8_t *) value);
+    if (interned != NULL)
+        return shark_table_get_index(self, SHARK_FROM_PTR(interned));
+    /* the key is built on the stack, unless it's too long for that */
+    union {
+        shark_string key;
+        uint8_t bytes[sizeof(shark_string) + 64];
+    } local;
     size_t size = strlen(value);
-    shark_string key = (shark_string) {{ &shark_string_class, 1 },
-        size, shark_hash_byte_str(size, (uint8_t *) value), value };
-    return shark_table_get_index(self, SHARK_FROM_PTR(&key));
+    shark_string *key = size < 64 ? &local.key : shark_string_alloc(size);
+    key->super.type = &shark_string_class;
+    key->super.ref_count = 1;
+    key->size = size;
+    memcpy(key->data, value, size + 1);
+    shark_string_init(key);
+    shark_value result = shark_table_get_index(self, SHARK_FROM_PTR(key));
+    if (key != &local.key) shark_free(key);
+    return result;
 }
 
+#ifdef SHARK_TABLE_SWISS
+
+/* Rebuilding also drops every deleted marker. */
 static void shark_table_resize(shark_table *self)
 {
     size_t old_size = self->size;
     shark_table_slot *old_data = self->data;
+    uint8_t *old_ctrl = self->ctrl;
 
     shark_table_set_closest_size(self, (size_t) (self->count * 1.333));
     self->data = shark_zalloc(sizeof(shark_table_slot) * self->size);
+    shark_table_ctrl_init(self);
 
     for (size_t i = 0; i < old_size; i++)
     {
         size_t slot_hash = old_data[i].hash;
         if (slot_hash == SHARK_TABLE_HASH_NULL) continue;
 
-        size_t mask = self->mask;
-        size_t slot_index = slot_hash & mask;
-        size_t step = 0;
+        size_t slot_index = shark_table_find_free(self, slot_hash);
+        self->ctrl[slot_index] = shark_table_mix(slot_hash) & 0x7F;
+        self->data[slot_index] = old_data[i];
+    }
 
-        while (self->data[slot_index].hash != SHARK_TABLE_HASH_NULL)
-        {
-            step++;
-            slot_index += step;
-            slot_index &= mask;
-        }
+    shark_free(old_data);
+    shark_free(old_ctrl);
+}
+
+static void shark_table_maybe_resize(shark_table *self)
+{
+    if (self->growth == 0
+    || (self->size > self->count * 4 && self->size > SHARK_TABLE_INIT_SIZE))
+        shark_table_resize(self);
+}
+
+#elif defined(SHARK_TABLE_COMPACT)
+
+/* Live entries are moved down over the holes left by deletions, keeping
+** their order, and the index is built anew for them. */
+static void shark_table_resize(shark_table *self)
+{
+    size_t old_used = self->used;
+    shark_table_slot *old_data = self->data;
+
+    shark_table_set_closest_size(self, self->count * 2);
+    self->data = shark_zalloc(sizeof(shark_table_slot) * SHARK_TABLE_USABLE(self->size));
+    shark_free(self->index);
+    shark_table_index_init(self);
+    self->used = 0;
+    self->filled = 0;
+
+    for (size_t i = 0; i < old_used; i++)
+    {
+        if (old_data[i].hash == SHARK_TABLE_HASH_NULL) continue;
+        shark_table_index_insert(self, old_data[i].hash, self->used);
+        self->data[self->used++] = old_data[i];
+    }
+
+    shark_free(old_data);
+}
+
+/* Removed keys leave a dummy in the index (and a hole in the entries unless
+** it was the last one), so the index fills up with deletions as well as
+** insertions and is rebuilt before running out of empty slots. There are
+** never more entries than filled index slots. */
+static void shark_table_maybe_resize(shark_table *self)
+{
+    if (self->filled >= SHARK_TABLE_USABLE(self->size)
+    || (self->count * 8 < self->size && self->size > SHARK_TABLE_INIT_SIZE))
+        shark_table_resize(self);
+}
 
-        self->data[slot_index].hash = slot_hash;
-        self->data[slot_index].key = old_data[i].key;
-        self->data[slot_index].value = old_data[i].value;
+#else
+
+static void shark_table_resize(shark_table *self)
+{
+    shark_table_finish_rehash(self);
+
+    size_t old_size = self->size;
+#ifdef SHARK_TABLE_INCREMENTAL
+    size_t old_used = self->count + self->deleted;
+#endif
+    shark_table_slot *old_data = self->data;
+
+    shark_table_set_closest_size(self, self->count * 2);
+    self->data = shark_zalloc(sizeof(shark_table_slot) * self->size);
+    self->deleted = 0;
+
+#ifdef SHARK_TABLE_INCREMENTAL
+    /* probes of the old array need an empty slot to end on */
+    if (old_size > SHARK_TABLE_REHASH_STEP && old_used < old_size) {
+        self->old_data = old_data;
+        self->old_size = old_size;
+        self->migrated = 0;
+        return;
     }
+#endif
+
+    for (size_t i = 0; i < old_size; i++)
+    {
+        if (old_data[i].hash != SHARK_TABLE_HASH_NULL)
+            shark_table_place(self, &old_data[i]);
+    }
+
+    shark_free(old_data);
 }
 
+/* Tables are rebuilt past 3/4 load (tombstones included) and below 1/8, in
+** both cases to under half full, so one hovering around either edge doesn't
+** rebuild again right away. */
 static void shark_table_maybe_resize(shark_table *self)
 {
-    if ((self->size > self->count * 4 && self->size > SHARK_TABLE_INIT_SIZE)
-    || (self->size <= self->count + (self->count / 16)))
+    if ((self->count + self->deleted) * 4 > self->size * 3
+    || (self->count * 8 < self->size && self->size > SHARK_TABLE_INIT_SIZE))
         shark_table_resize(self);
 }
 
+#endif
+
 static void shark_table_insert(shark_table *self, size_t slot, size_t hash,
                         shark_value key, shark_value value)
 {
     size_t old_hash = self->data[slot].hash;
+#if !defined(SHARK_TABLE_SWISS) && !defined(SHARK_TABLE_COMPACT)
+    if (SHARK_TABLE_IS_TOMBSTONE(self->data[slot])) self->deleted--;
+#endif
 
     if (old_hash != SHARK_TABLE_HASH_NULL)
     {
@@ -524,6 +1578,13 @@ static void shark_table_insert(shark_table *self, size_t slot, size_t hash,
 
     if (old_hash == SHARK_TABLE_HASH_NULL)
     {
+#if defined(SHARK_TABLE_SWISS)
+        if (self->ctrl[slot] == SHARK_TABLE_CTRL_EMPTY) self->growth--;
+        self->ctrl[slot] = shark_table_mix(hash) & 0x7F;
+#elif defined(SHARK_TABLE_COMPACT)
+        shark_table_index_insert(self, hash, slot);
+        self->used++;
+#endif
         self->count++;
         shark_table_maybe_resize(self);
     }
@@ -531,6 +1592,10 @@ static void shark_table_insert(shark_table *self, size_t slot, size_t hash,
 
 SHARK_API void shark_table_set_index(shark_table *self, shark_value key, shark_value value)
 {
+    if (self->shape != NULL) {
+        shark_table_shaped_set(self, key, value);
+        return;
+    }
     size_t hash;
     size_t slot = shark_table_lookup_slot(self, key, &hash);
     shark_table_insert(self, slot, hash, key, value);
@@ -538,18 +1603,44 @@ SHARK_API void shark_table_set_index(shark_table *self, shark_value key, shark_v
 
 SHARK_API shark_bool_t shark_table_contains(shark_table *self, shark_value key)
 {
+    if (self->shape != NULL) {
+        size_t index;
+        return shark_shape_lookup(self->shape, key, &index);
+    }
     size_t slot = shark_table_lookup_slot(self, key, NULL);
     return self->data[slot].hash != SHARK_TABLE_HASH_NULL;
 }
 
 static void shark_table_remove_slot(shark_table *self, size_t slot)
 {
+    if (self->data[slot].hash == SHARK_TABLE_HASH_NULL) return;
+#ifdef SHARK_TABLE_SWISS
+    /* a group that still has an empty slot never made a probe move past it,
+    ** so the slot can go back to empty instead of being marked deleted. */
+    uint8_t *group = self->ctrl + slot / SHARK_TABLE_GROUP_SIZE * SHARK_TABLE_GROUP_SIZE;
+    if (shark_table_group_match(group, SHARK_TABLE_CTRL_EMPTY) != 0) {
+        self->ctrl[slot] = SHARK_TABLE_CTRL_EMPTY;
+        self->growth++;
+    } else {
+        self->ctrl[slot] = SHARK_TABLE_CTRL_DELETED;
+    }
+    memset(&self->data[slot], 0, sizeof(shark_table_slot));
+#elif defined(SHARK_TABLE_COMPACT)
+    shark_table_ix_set(self, shark_table_index_find(self, self->data[slot].hash, slot), SHARK_TABLE_IX_DUMMY);
     memset(&self->data[slot], 0, sizeof(shark_table_slot));
+    /* holes at the end are reused right away */
+    while (self->used > 0 && self->data[self->used - 1].hash == SHARK_TABLE_HASH_NULL)
+        self->used--;
+#else
+    shark_table_bury(&self->data[slot]);
+    self->deleted++;
+#endif
     self->count--;
 }
 
 SHARK_API void shark_table_delete_index(shark_table *self, shark_value key)
 {
+    if (self->shape != NULL) shark_table_unshape(self);
     size_t slot = shark_table_lookup_slot(self, key, NULL);
 
     shark_value_dec_ref(self->data[slot].key);
@@ -561,6 +1652,7 @@ SHARK_API void shark_table_delete_index(shark_table *self, shark_value key)
 
 SHARK_API shark_value shark_table_pop_index(shark_table *self, shark_value key)
 {
+    if (self->shape != NULL) shark_table_unshape(self);
     size_t slot = shark_table_lookup_slot(self, key, NULL);
     shark_value value = SHARK_NULL;
     if (self->data[slot].hash != SHARK_TABLE_HASH_NULL)
@@ -573,21 +1665,269 @@ SHARK_API shark_value shark_table_pop_index(shark_table *self, shark_value key)
 
 SHARK_API void shark_table_update(shark_table *self, shark_table *other)
 {
-    for (size_t i = 0; i < other->size; i++)
+    if (other->shape != NULL) {
+        shark_table *offsets = other->shape->offsets;
+        shark_table_finish_rehash(offsets);
+        for (size_t i = 0; i < SHARK_TABLE_END(offsets); i++)
+        {
+            if (offsets->data[i].hash != SHARK_TABLE_HASH_NULL)
+                shark_table_set_index(self, offsets->data[i].key,
+                    other->fields[SHARK_AS_INT(offsets->data[i].value) - 1]);
+        }
+        return;
+    }
+    shark_table_finish_rehash(other);
+    for (size_t i = 0; i < SHARK_TABLE_END(other); i++)
     {
         if (other->data[i].hash != SHARK_TABLE_HASH_NULL)
             shark_table_set_index(self, other->data[i].key, other->data[i].value);
     }
 }
 
+static void shark_shape_destroy(shark_object *object)
+{
+    shark_shape *self = (shark_shape *) object;
+    shark_object_dec_ref(self->offsets);
+    shark_object_dec_ref(self->transitions);
+}
+
+static void shark_shape_traverse(shark_object *object, void (*visit)(shark_object *))
+{
+    shark_shape *self = (shark_shape *) object;
+    visit((shark_object *) self->offsets);
+    visit((shark_object *) self->transitions);
+}
+
+static shark_class shark_shape_class = {
+    { &shark_class_class, 1 },
+    NULL,
+    "shape",
+    &shark_object_class,
+    sizeof(shark_shape),
+    shark_shape_destroy,
+    false,
+    NULL,
+    NULL,
+    shark_shape_traverse
+};
+
+SHARK_API shark_shape *shark_shape_new()
+{
+    shark_shape *self = shark_object_new(&shark_shape_class);
+    self->count = 0;
+    self->offsets = shark_table_new();
+    self->transitions = shark_table_new();
+    return self;
+}
+
+/* offsets are stored one based so a missing key (null) can't be confused
+** with the first field. */
+static bool shark_shape_lookup(shark_shape *self, shark_value key, size_t *index)
+{
+    shark_value offset = shark_table_get_index(self->offsets, key);
+    if (SHARK_IS_NULL(offset)) return false;
+    *index = (size_t) SHARK_AS_INT(offset) - 1;
+    return true;
+}
+
+/* Returns the shape reached by adding 'key' to 'self', creating it on first
+** use. Returns NULL when the table should give up on shapes instead. */
+static shark_shape *shark_shape_transition(shark_shape *self, shark_value key)
+{
+    shark_value next = shark_table_get_index(self->transitions, key);
+    if (SHARK_IS_OBJECT(next))
+        return (shark_shape *) SHARK_AS_PTR(next);
+    
+    if (self->count >= SHARK_SHAPE_MAX_FIELDS
+    || self->transitions->count >= SHARK_SHAPE_MAX_TRANSITIONS)
+        return NULL;
+    
+    shark_shape *child = shark_object_new(&shark_shape_class);
+    child->count = self->count + 1;
+    child->offsets = shark_table_copy(self->offsets);
+    child->transitions = shark_table_new();
+    shark_table_set_index(child->offsets, key, SHARK_FROM_INT(child->count));
+    shark_table_set_index(self->transitions, key, SHARK_FROM_PTR(child));
+    shark_object_dec_ref(child);
+    
+    return child;
+}
+
+static void shark_table_shaped_append(shark_table *self, shark_shape *next, shark_value value)
+{
+    if (self->count == self->capacity)
+    {
+        self->capacity = self->capacity == 0 ? SHARK_SHAPE_INIT_FIELDS : self->capacity << 1;
+        self->fields = shark_realloc(self->fields, sizeof(shark_value) * self->capacity);
+    }
+    self->fields[self->count++] = shark_value_inc_ref(value);
+    shark_object_inc_ref(next);
+    shark_object_dec_ref(self->shape);
+    self->shape = next;
+}
+
+static void shark_table_shaped_replace(shark_table *self, size_t index, shark_value value)
+{
+    shark_value_inc_ref(value);
+    shark_value_dec_ref(self->fields[index]);
+    self->fields[index] = value;
+}
+
+static void shark_table_shaped_set(shark_table *self, shark_value key, shark_value value)
+{
+    size_t index;
+    if (shark_shape_lookup(self->shape, key, &index)) {
+        shark_table_shaped_replace(self, index, value);
+        return;
+    }
+    shark_shape *next = shark_shape_transition(self->shape, key);
+    if (next != NULL) {
+        shark_table_shaped_append(self, next, value);
+    } else {
+        shark_table_unshape(self);
+        shark_table_set_index(self, key, value);
+    }
+}
+
+/* Moves the fields of a shaped table into a regular hash array. */
+static void shark_table_unshape(shark_table *self)
+{
+    shark_shape *shape = self->shape;
+    shark_value *fields = self->fields;
+    shark_table *offsets = shape->offsets;
+    
+    shark_table_init(self);
+    shark_table_finish_rehash(offsets);
+    
+    for (size_t i = 0; i < SHARK_TABLE_END(offsets); i++)
+    {
+        if (offsets->data[i].hash != SHARK_TABLE_HASH_NULL) {
+            shark_value value = fields[SHARK_AS_INT(offsets->data[i].value) - 1];
+            shark_table_set_index(self, offsets->data[i].key, value);
+            shark_value_dec_ref(value);
+        }
+    }
+    
+    shark_free(fields);
+    shark_object_dec_ref(shape);
+}
+
+#define SHARK_SAME_OBJECT(x, y)     (SHARK_IS_OBJECT(x) && SHARK_IS_OBJECT(y) \
+                                    && SHARK_AS_PTR(x) == SHARK_AS_PTR(y))
+
+/* Field lookups through an inline cache. For shaped tables the cache
+** remembers the shape it last saw and the field index in it, or for a store
+** that added the field, the shape that store transitions to. For hashed
+** tables it remembers the slot where the field was last found and the key
+** object stored there; tables filled in the same order share their layout,
+** so the slot usually holds the very same key and the lookup needs no
+** hashing or string compare. The cache keeps references to the shapes and
+** key it remembers, so a match is never a stale one. */
+static void shark_field_cache_fill(shark_field_cache *cache, shark_shape *shape, shark_shape *next, size_t index)
+{
+    shark_object_inc_ref(shape);
+    shark_object_inc_ref(next);
+    shark_object_dec_ref(cache->shape);
+    shark_object_dec_ref(cache->next);
+    cache->shape = shape;
+    cache->next = next;
+    cache->index = index;
+}
+
+static size_t shark_table_lookup_cached(shark_table *self, shark_field_cache *cache)
+{
+    size_t slot = cache->slot;
+    if (slot < SHARK_TABLE_END(self) && SHARK_SAME_OBJECT(self->data[slot].key, cache->key))
+        return slot;
+    slot = shark_table_lookup_slot(self, cache->name, NULL);
+    if (self->data[slot].hash != SHARK_TABLE_HASH_NULL)
+    {
+        shark_value_inc_ref(self->data[slot].key);
+        shark_value_dec_ref(cache->key);
+        cache->key = self->data[slot].key;
+        cache->slot = slot;
+    }
+    return slot;
+}
+
+SHARK_API shark_value shark_table_get_cached(shark_table *self, shark_field_cache *cache)
+{
+    if (self->shape != NULL) {
+        if (self->shape == cache->shape && cache->next == NULL)
+            return self->fields[cache->index];
+        size_t index;
+        if (!shark_shape_lookup(self->shape, cache->name, &index))
+            return SHARK_NULL;
+        shark_field_cache_fill(cache, self->shape, NULL, index);
+        return self->fields[index];
+    }
+    return self->data[shark_table_lookup_cached(self, cache)].value;
+}
+
+SHARK_API void shark_table_set_cached(shark_table *self, shark_field_cache *cache, shark_value value)
+{
+    if (self->shape != NULL) {
+        shark_shape *shape = self->shape;
+        if (shape == cache->shape) {
+            if (cache->next == NULL)
+                shark_table_shaped_replace(self, cache->index, value);
+            else
+                shark_table_shaped_append(self, cache->next, value);
+            return;
+        }
+        size_t index;
+        if (shark_shape_lookup(shape, cache->name, &index)) {
+            shark_field_cache_fill(cache, shape, NULL, index);
+            shark_table_shaped_replace(self, index, value);
+            return;
+        }
+        shark_shape *next = shark_shape_transition(shape, cache->name);
+        if (next != NULL) {
+            shark_field_cache_fill(cache, shape, next, shape->count);
+            shark_table_shaped_append(self, next, value);
+            return;
+        }
+        shark_table_unshape(self);
+    }
+    size_t slot = shark_table_lookup_cached(self, cache);
+    if (self->data[slot].hash != SHARK_TABLE_HASH_NULL) {
+        shark_value_inc_ref(value);
+        shark_value_dec_ref(self->data[slot].value);
+        self->data[slot].value = value;
+    } else {
+        shark_table_set_index(self, cache->name, value);
+    }
+}
+
+static void shark_method_cache_clear(shark_method_cache *cache)
+{
+    for (size_t i = 0; i < SHARK_METHOD_CACHE_WAYS; i++) {
+        shark_object_dec_ref(cache->type[i]);
+        shark_object_dec_ref(cache->method[i]);
+        cache->type[i] = NULL;
+        cache->method[i] = NULL;
+    }
+    cache->next = 0;
+}
+
 static void shark_module_destroy(shark_object *object)
 {
     shark_module *self = (shark_module *) object;
-    shark_object_delete(self->names);
+    shark_object_dec_ref(self->names);
     for (size_t i = 0; i < self->const_table_size; i++)
         shark_value_dec_ref(self->const_table[i]);
     shark_free(self->const_table);
-    shark_free(self->code);
+    if (self->code_map == NULL) shark_free(self->code);
+    shark_object_dec_ref(self->code_map);
+    for (size_t i = 0; i < self->field_cache_count; i++) {
+        shark_value_dec_ref(self->field_cache[i].key);
+        shark_object_dec_ref(self->field_cache[i].shape);
+        shark_object_dec_ref(self->field_cache[i].next);
+    }
+    shark_free(self->field_cache);
+    for (size_t i = 0; i < self->method_cache_count; i++)
+        shark_method_cache_clear(&self->method_cache[i]);
+    shark_free(self->method_cache);
 }
 
 static shark_class shark_module_class = {
@@ -601,29 +1941,134 @@ static shark_class shark_module_class = {
     NULL
 };
 
-#define fetch       ((uint8_t) fgetc(source))
+/* Archives are read from memory: the file mapped where mmap is available
+** (privately, so quickening can still patch the code), read in whole with
+** stdio otherwise. The code of every module points straight into it, and
+** it stays around while any module or index entry does. */
+typedef struct {
+    shark_object super;
+    uint8_t *data;
+    size_t size;
+    bool mapped;
+} shark_archive_map;
+
+static void shark_archive_map_destroy(shark_object *object)
+{
+    shark_archive_map *self = (shark_archive_map *) object;
+#ifdef SHARK_ARCHIVE_MMAP
+    if (self->mapped) {
+        munmap(self->data, self->size);
+        return;
+    }
+#endif
+    shark_free(self->data);
+}
+
+static shark_class shark_archive_map_class = {
+    { &shark_class_class, 1 },
+    NULL,
+    "archive_map",
+    &shark_object_class,
+    sizeof(shark_archive_map),
+    shark_archive_map_destroy,
+    false,
+    NULL
+};
+
+typedef struct {
+    uint8_t *at;
+    uint8_t *end;
+    shark_archive_map *map;
+} shark_archive_source;
+
+#ifdef SHARK_ARCHIVE_MMAP
+
+/* Returns false when the file can't be mapped, like a pipe or an empty file. */
+static bool shark_archive_map_file(shark_archive_map *map, FILE *file)
+{
+    struct stat info;
+    if (fstat(fileno(file), &info) != 0 || !S_ISREG(info.st_mode) || info.st_size == 0)
+        return false;
+    size_t size = (size_t) info.st_size;
+    void *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fileno(file), 0);
+    if (data == MAP_FAILED) return false;
+    map->data = data;
+    map->size = size;
+    map->mapped = true;
+    return true;
+}
+
+#endif
+
+static void shark_archive_open(shark_archive_source *source, FILE *file)
+{
+    shark_archive_map *map = shark_object_new(&shark_archive_map_class);
+    source->map = map;
+#ifdef SHARK_ARCHIVE_MMAP
+    if (!shark_archive_map_file(map, file))
+#endif
+    {
+        size_t size = 0;
+        size_t capacity = 4096;
+        uint8_t *data = shark_malloc(capacity);
+        size_t count;
+        while ((count = fread(data + size, 1, capacity - size, file)) != 0) {
+            size += count;
+            if (size == capacity) {
+                capacity <<= 1;
+                data = shark_realloc(data, capacity);
+            }
+        }
+        map->data = data;
+        map->size = size;
+        map->mapped = false;
+    }
+    source->at = map->data;
+    source->end = map->data + map->size;
+}
+
+static uint8_t *shark_archive_take(shark_archive_source *source, size_t size)
+{
+    if ((size_t) (source->end - source->at) < size)
+        shark_fatal_error(NULL, "truncated archive.");
+    uint8_t *data = source->at;
+    source->at += size;
+    return data;
+}
 
-#define fetch_short (((uint16_t) fetch) \
-                    | (((uint16_t) fetch) << 8))
+static uint16_t shark_archive_short(uint8_t *data)
+{
+    return (uint16_t) data[0] | ((uint16_t) data[1] << 8);
+}
 
-#define fetch_int   (((uint32_t) fetch) \
-                    | (((uint32_t) fetch) << 8) \
-                    | (((uint32_t) fetch) << 16) \
-                    | (((uint32_t) fetch) << 24))
+static uint32_t shark_archive_int(uint8_t *data)
+{
+    return (uint32_t) data[0] | ((uint32_t) data[1] << 8)
+        | ((uint32_t) data[2] << 16) | ((uint32_t) data[3] << 24);
+}
+
+/* Strings are interned anyway, one that already is needs no copy. */
+static shark_string *shark_archive_str(shark_archive_source *source, size_t size)
+{
+    uint8_t *data = shark_archive_take(source, size);
+    shark_string *self = shark_string_find_interned(size, data);
+    if (self != NULL) return shark_object_inc_ref(self);
+    self = shark_string_alloc(size);
+    memcpy(self->data, data, size);
+    shark_string_init(self);
+    return shark_string_intern(self);
+}
+
+#define fetch       (*shark_archive_take(source, 1))
+#define fetch_short shark_archive_short(shark_archive_take(source, 2))
+#define fetch_int   shark_archive_int(shark_archive_take(source, 4))
 
 #define fetch_str(dest) { \
     size_t size = (size_t) fetch_short; \
-    dest = shark_object_new(&shark_string_class); \
-    dest->size = size; \
-    uint8_t *data = shark_malloc(size * sizeof(uint8_t) + 1); \
-    data[size] = '\0'; \
-    dest->data = data; \
-    for (size_t i = 0; i < size; i++) \
-        *(data++) = fetch; \
-    shark_string_init(dest); \
+    dest = shark_archive_str(source, size); \
 }
 
-static shark_module *shark_read_module(shark_string *name, FILE *source)
+static shark_module *shark_read_module(shark_string *name, shark_archive_source *source)
 {
     shark_module *module = shark_object_new(&shark_module_class);
 
@@ -685,9 +2130,8 @@ static shark_module *shark_read_module(shark_string *name, FILE *source)
             {
                 size_t size = (size_t) fetch_short;
                 char data[size + 1];
+                memcpy(data, shark_archive_take(source, size), size);
                 data[size] = '\0';
-                for (size_t i = 0; i < size; i++)
-                    data[i] = fetch;
                 value = SHARK_FROM_NUM(atof(&data[0]));
                 break;
             }
@@ -699,47 +2143,236 @@ static shark_module *shark_read_module(shark_string *name, FILE *source)
                 else
                     shark_fatal_error(NULL, "can't decode non ascii character.");
                 break;
-            }
+            }
+            case CONST_STR:
+            case CONST_SYMBOL:
+            {
+                shark_string *str;
+                fetch_str(str);
+                value = SHARK_FROM_PTR(str);
+                break;
+            }
+            default:
+            {
+                shark_fatal_error(NULL, "unknown const type.");
+                break;
+            }
+        }
+
+        *(const_table++) = value;
+    }
+
+    size_t code_size = (size_t) fetch_int;
+    module->code = shark_archive_take(source, code_size);
+    module->code_size = code_size;
+    module->code_map = shark_object_inc_ref(source->map);
+    
+    module->field_cache_count = 0;
+    module->field_cache_size = 0;
+    module->field_cache = NULL;
+    module->method_cache_count = 0;
+    module->method_cache_size = 0;
+    module->method_cache = NULL;
+
+    return module;
+}
+
+static void shark_skip_str(shark_archive_source *source)
+{
+    size_t size = (size_t) fetch_short;
+    shark_archive_take(source, size);
+}
+
+/* Walks past a module the way shark_read_module reads it, building nothing. */
+static void shark_skip_module(shark_archive_source *source)
+{
+    size_t import_section_size = (size_t) fetch_short;
+
+    for (size_t i = 0; i < import_section_size; i++)
+    {
+        shark_skip_str(source);
+        if (fetch == 0) {
+            shark_skip_str(source);
+        } else {
+            size_t target_count = (size_t) fetch_short;
+            for (size_t i = 0; i < target_count; i++)
+                shark_skip_str(source);
+        }
+    }
+
+    size_t const_table_size = (size_t) fetch_short;
+
+    for (size_t i = 0; i < const_table_size; i++)
+    {
+        switch (fetch)
+        {
+            case CONST_INT:
+                shark_archive_take(source, 4);
+                break;
+            case CONST_FLOAT:
+            case CONST_CHAR:
             case CONST_STR:
             case CONST_SYMBOL:
-            {
-                shark_string *str;
-                fetch_str(str);
-                value = SHARK_FROM_PTR(str);
+                shark_skip_str(source);
                 break;
-            }
             default:
-            {
                 shark_fatal_error(NULL, "unknown const type.");
                 break;
-            }
         }
-
-        *(const_table++) = value;
     }
 
     size_t code_size = (size_t) fetch_int;
-    uint8_t *code = shark_malloc(code_size * sizeof(uint8_t));
-    module->code = code;
+    shark_archive_take(source, code_size);
+}
+
+/* Loading an archive only indexes its modules, the module record maps
+** their names to one of these until they're first imported. */
+typedef struct {
+    shark_object super;
+    shark_archive_map *map;
+    uint8_t *start;
+} shark_archive_entry;
 
-    for (size_t i = 0; i < code_size; i++)
-        *(code++) = fetch;
+static void shark_archive_entry_destroy(shark_object *object)
+{
+    shark_object_dec_ref(((shark_archive_entry *) object)->map);
+}
+
+static shark_class shark_archive_entry_class = {
+    { &shark_class_class, 1 },
+    NULL,
+    "archive_entry",
+    &shark_object_class,
+    sizeof(shark_archive_entry),
+    shark_archive_entry_destroy,
+    false,
+    NULL
+};
+
+/* Registered native modules are recorded the same way, with the function
+** that binds them. */
+typedef struct {
+    shark_object super;
+    shark_module_binder bind;
+} shark_native_entry;
+
+static shark_class shark_native_entry_class = {
+    { &shark_class_class, 1 },
+    NULL,
+    "native_entry",
+    &shark_object_class,
+    sizeof(shark_native_entry),
+    shark_default_destroy,
+    false,
+    NULL
+};
 
+/* Returns the module recorded under 'name', reading it from its archive
+** (or binding it) on first use, or NULL if there's none. */
+static shark_module *shark_vm_find_module(shark_vm *vm, shark_string *name)
+{
+    shark_value record = shark_table_get_index(vm->module_record, SHARK_FROM_PTR(name));
+    if (!SHARK_IS_OBJECT(record)) return NULL;
+    shark_module *module;
+    if (SHARK_AS_OBJECT(record)->type == &shark_archive_entry_class) {
+        shark_archive_entry *entry = (shark_archive_entry *) SHARK_AS_OBJECT(record);
+        shark_archive_source archive = { entry->start, entry->map->data + entry->map->size, entry->map };
+        module = shark_read_module(shark_object_inc_ref(name), &archive);
+    } else if (SHARK_AS_OBJECT(record)->type == &shark_native_entry_class) {
+        module = shark_vm_bind_module(vm, (char *) name->data);
+        ((shark_native_entry *) SHARK_AS_OBJECT(record))->bind(vm, module);
+    } else {
+        return SHARK_AS_MODULE(record);
+    }
+    shark_table_set_index(vm->module_record, SHARK_FROM_PTR(name), SHARK_FROM_PTR(module));
+    shark_object_dec_ref(module);
     return module;
 }
 
-SHARK_API shark_module *shark_read_archive(shark_vm *vm, shark_string *name, void *source_file)
+#ifdef SHARK_IMPORT_LISTING
+
+/* Returns a set of the names in directory 'path', or true when it can't
+** be listed. */
+static shark_value shark_list_dir(shark_string *path)
+{
+    DIR *dir = opendir((char *) path->data);
+    if (dir == NULL) return SHARK_TRUE;
+    shark_table *names = shark_table_new();
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        shark_string *name = shark_string_new_from_cstr(entry->d_name);
+        shark_table_set_index(names, SHARK_FROM_PTR(name), SHARK_TRUE);
+        shark_object_dec_ref(name);
+    }
+    closedir(dir);
+    return SHARK_FROM_PTR(names);
+}
+
+#endif
+
+/* Each import path is listed the first time an archive is looked for in it,
+** so archives are then only opened where they are instead of tried in every
+** path in turn. Returns false when the listing says the archive isn't in
+** 'import_path'. */
+static bool shark_vm_may_contain(shark_vm *vm, shark_string *import_path, shark_string *archive_name)
+{
+#ifdef SHARK_IMPORT_LISTING
+    if (memchr(archive_name->data, '/', archive_name->size) != NULL) return true;
+    shark_value listing = shark_table_get_index(vm->import_listing, SHARK_FROM_PTR(import_path));
+    if (SHARK_IS_NULL(listing)) {
+        listing = shark_list_dir(import_path);
+        shark_table_set_index(vm->import_listing, SHARK_FROM_PTR(import_path), listing);
+        shark_value_dec_ref(listing);
+    }
+    if (!SHARK_IS_OBJECT(listing)) return true;
+    return shark_table_contains(SHARK_AS_TABLE(listing), SHARK_FROM_PTR(archive_name));
+#else
+    return true;
+#endif
+}
+
+/* Opens the archive in the first import path that has it. Listings are taken
+** once, so a lookup that trusts them and fails is retried without. */
+static FILE *shark_vm_open_archive(shark_vm *vm, shark_string *archive_name, bool use_listing)
 {
-    FILE *source = source_file;
+    size_t path_size = vm->max_import_path + 1 + archive_name->size;
+    char *path = shark_malloc(path_size + 1);
+    FILE *archive_file = NULL;
+    
+    for (size_t i = 0; i < vm->import_path->length; i++)
+    {
+        shark_string *import_path = SHARK_AS_STR(vm->import_path->data[i]);
+        if (use_listing && !shark_vm_may_contain(vm, import_path, archive_name))
+            continue;
+        memcpy(path, import_path->data, import_path->size);
+        path[import_path->size] = '/';
+        memcpy(path + import_path->size + 1, archive_name->data, archive_name->size);
+        path[import_path->size + 1 + archive_name->size] = '\0';
+        
+        archive_file = fopen(path, "rb");
+        if (archive_file != NULL) break;
+    }
     
+    shark_free(path);
+    return archive_file;
+}
+
+/* Indexes the modules of an archive and the ones it imports, returns the
+** name of its main module (NULL if it was loaded already). */
+static shark_string *shark_index_archive(shark_vm *vm, shark_string *name, FILE *source_file)
+{
     if (shark_table_contains(vm->archive_record, SHARK_FROM_PTR(name)))
         return NULL;
     
     shark_table_set_index(vm->archive_record, SHARK_FROM_PTR(name), SHARK_TRUE);
     
+    shark_archive_source archive;
+    shark_archive_source *source = &archive;
+    shark_archive_open(source, source_file);
+    
     size_t main_name_size = fetch;
     shark_string *main_name = shark_string_new_with_size(main_name_size);
-    for (size_t i = 0; i < main_name_size; i++) main_name->data[i] = fetch;
+    memcpy(main_name->data, shark_archive_take(source, main_name_size), main_name_size);
     shark_string_init(main_name);
     
     size_t import_table_size = (size_t) fetch;
@@ -748,50 +2381,49 @@ SHARK_API shark_module *shark_read_archive(shark_vm *vm, shark_string *name, voi
     {
         size_t archive_name_size = fetch;
         shark_string *archive_name = shark_string_new_with_size(archive_name_size);
-        for (size_t k = 0; k < archive_name_size; k++)
-            archive_name->data[k] = fetch;
+        memcpy(archive_name->data, shark_archive_take(source, archive_name_size), archive_name_size);
         shark_string_init(archive_name);
         
-        size_t path_size = vm->max_import_path + 1 + archive_name->size;
-        char *path = shark_malloc(path_size + 1);
-        FILE *source = NULL;
-        
-        for (size_t i = 0; i < vm->import_path->length; i++)
-        {
-            shark_string *import_path = SHARK_AS_STR(vm->import_path->data[i]);
-            memcpy(path, import_path->data, import_path->size);
-            path[import_path->size] = '/';
-            memcpy(path + import_path->size + 1, archive_name->data, archive_name->size);
-            path[import_path->size + 1 + archive_name->size] = '\0';
-            
-            source = fopen(path, "rb");
-            if (source != NULL) break;
-        }
+        FILE *archive_file = shark_vm_open_archive(vm, archive_name, true);
+        if (archive_file == NULL) archive_file = shark_vm_open_archive(vm, archive_name, false);
         
-        shark_free(path);
-        
-        if (source == NULL)
+        if (archive_file == NULL)
         {
-            fprintf(stderr, "can't locate archive '%s', execution aborted.", name->data);
+            fprintf(stderr, "can't locate archive '%s', execution aborted.", archive_name->data);
+            shark_object_dec_ref(archive_name);
             exit(EXIT_FAILURE);
         }
         
-        shark_read_archive(vm, archive_name, source);
-        fclose(source);
+        shark_object_dec_ref(shark_index_archive(vm, archive_name, archive_file));
+        shark_object_dec_ref(archive_name);
+        fclose(archive_file);
     }
     
-    while (true)
+    while (source->at < source->end)
     {
-        int c = fgetc(source);
-        ungetc(c, source);
-        if (c == EOF) break;
         shark_string *module_name;
         fetch_str(module_name);
-        shark_module *module = shark_read_module(module_name, source);
-        shark_table_set_index(vm->module_record, SHARK_FROM_PTR(module_name), SHARK_FROM_PTR(module));
+        shark_archive_entry *entry = shark_object_new(&shark_archive_entry_class);
+        entry->map = shark_object_inc_ref(source->map);
+        entry->start = source->at;
+        shark_skip_module(source);
+        shark_table_set_index(vm->module_record, SHARK_FROM_PTR(module_name), SHARK_FROM_PTR(entry));
+        shark_object_dec_ref(entry);
+        shark_object_dec_ref(module_name);
     }
     
-    return SHARK_AS_MODULE(shark_table_get_index(vm->module_record, SHARK_FROM_PTR(main_name)));
+    shark_object_dec_ref(source->map);
+    
+    return main_name;
+}
+
+SHARK_API shark_module *shark_read_archive(shark_vm *vm, shark_string *name, void *source_file)
+{
+    shark_string *main_name = shark_index_archive(vm, name, source_file);
+    if (main_name == NULL) return NULL;
+    shark_module *module = shark_vm_find_module(vm, main_name);
+    shark_object_dec_ref(main_name);
+    return module;
 }
 
 #undef fetch
@@ -881,6 +2513,11 @@ SHARK_API shark_string *shark_path_join(shark_string *x, shark_string *y)
     return join;
 }
 
+#ifdef SHARK_JIT
+static void shark_jit_init();
+static void shark_jit_release(shark_jit_code *jit);
+#endif
+
 SHARK_API void shark_function_destroy(shark_object *object)
 {
     shark_function *self = (shark_function *) object;
@@ -888,6 +2525,10 @@ SHARK_API void shark_function_destroy(shark_object *object)
     shark_object_dec_ref(self->owner);
     shark_object_dec_ref(self->owner_class);
     shark_object_dec_ref(self->supermethod);
+#ifdef SHARK_JIT
+    if (self->jit != NULL)
+        shark_jit_release(self->jit);
+#endif
 }
 
 static shark_class shark_function_class = {
@@ -909,9 +2550,11 @@ SHARK_API shark_class *shark_class_new(shark_string *name, shark_class *parent)
     if (parent == NULL) self->object_size = sizeof(shark_table);
     else self->object_size = parent->object_size;
     self->destroy = shark_table_destroy;
+    self->traverse = shark_table_traverse;
     self->is_object_class = true;
     if (parent == NULL || parent->methods == NULL) self->methods = shark_table_new();
     else self->methods = shark_table_copy(parent->methods);
+    self->shape = NULL;
     return self;
 }
 
@@ -956,12 +2599,215 @@ SHARK_API void shark_print_stack_trace(shark_vm *vm)
     }
 }
 
+#ifdef SHARK_PROFILE_OPCODES
+
+/* Opcode pair counts, used to pick the superinstructions. Build with
+** -DSHARK_PROFILE_OPCODES and the most frequent pairs executed are written
+** to stderr when the process exits. */
+
+static const char *shark_opcode_name[256] = {
+    [OP_END] = "END",
+    [OP_NULL] = "NULL",
+    [OP_TRUE] = "TRUE",
+    [OP_FALSE] = "FALSE",
+    [OP_LOAD_GLOBAL] = "LOAD_GLOBAL",
+    [OP_LOAD] = "LOAD",
+    [OP_GET_FIELD] = "GET_FIELD",
+    [OP_ENTER_CLASS] = "ENTER_CLASS",
+    [OP_EXIT_CLASS] = "EXIT_CLASS",
+    [OP_DEFINE] = "DEFINE",
+    [OP_DEFINE_FIELD] = "DEFINE_FIELD",
+    [OP_FUNCTION] = "FUNCTION",
+    [OP_NOT_IMPLEMENTED] = "NOT_IMPLEMENTED",
+    [OP_EXIT] = "EXIT",
+    [OP_DUP] = "DUP",
+    [OP_DROP] = "DROP",
+    [OP_SWAP] = "SWAP",
+    [OP_MUL] = "MUL",
+    [OP_DIV] = "DIV",
+    [OP_MOD] = "MOD",
+    [OP_ADD] = "ADD",
+    [OP_SUB] = "SUB",
+    [OP_LT] = "LT",
+    [OP_LE] = "LE",
+    [OP_GT] = "GT",
+    [OP_GE] = "GE",
+    [OP_EQ] = "EQ",
+    [OP_NE] = "NE",
+    [OP_IN] = "IN",
+    [OP_NOT_IN] = "NOT_IN",
+    [OP_NEG] = "NEG",
+    [OP_NOT] = "NOT",
+    [OP_FUNCTION_CALL] = "FUNCTION_CALL",
+    [OP_METHOD_CALL] = "METHOD_CALL",
+    [OP_GET_SLICE] = "GET_SLICE",
+    [OP_GET_INDEX] = "GET_INDEX",
+    [OP_SELF] = "SELF",
+    [OP_SUPER_CALL] = "SUPER_CALL",
+    [OP_SIZEOF] = "SIZEOF",
+    [OP_NEW] = "NEW",
+    [OP_INSTANCEOF] = "INSTANCEOF",
+    [OP_ARRAY_NEW] = "ARRAY_NEW",
+    [OP_ARRAY_NEW_APPEND] = "ARRAY_NEW_APPEND",
+    [OP_TABLE_NEW] = "TABLE_NEW",
+    [OP_TABLE_NEW_INSERT] = "TABLE_NEW_INSERT",
+    [OP_CONST] = "CONST",
+    [OP_RETURN] = "RETURN",
+    [OP_INSERT] = "INSERT",
+    [OP_APPEND] = "APPEND",
+    [OP_STORE_GLOBAL] = "STORE_GLOBAL",
+    [OP_STORE] = "STORE",
+    [OP_SET_STATIC] = "SET_STATIC",
+    [OP_SET_FIELD] = "SET_FIELD",
+    [OP_SET_SLICE] = "SET_SLICE",
+    [OP_SET_INDEX] = "SET_INDEX",
+    [OP_GET_FIELD_TOP] = "GET_FIELD_TOP",
+    [OP_GET_INDEX_TOP] = "GET_INDEX_TOP",
+    [OP_GET_STATIC] = "GET_STATIC",
+    [OP_GET_STATIC_TOP] = "GET_STATIC_TOP",
+    [OP_IF] = "IF",
+    [OP_JUMP] = "JUMP",
+    [OP_LOOP] = "LOOP",
+    [OP_ZERO] = "ZERO",
+    [OP_INC] = "INC",
+    [OP_OR] = "OR",
+    [OP_AND] = "AND",
+    [OP_SET_INDEX_AU] = "SET_INDEX_AU",
+    [OP_SET_FIELD_AU] = "SET_FIELD_AU",
+    [OP_SET_STATIC_AU] = "SET_STATIC_AU",
+    [OP_ARRAY_CLOSE] = "ARRAY_CLOSE",
+    [OP_TABLE_CLOSE] = "TABLE_CLOSE",
+    [OP_BAND] = "BAND",
+    [OP_BOR] = "BOR",
+    [OP_BXOR] = "BXOR",
+    [OP_BSHL] = "BSHL",
+    [OP_BSHR] = "BSHR",
+    [OP_BNOT] = "BNOT",
+    [OP_LOAD_LOAD] = "LOAD_LOAD",
+    [OP_LOAD_CONST] = "LOAD_CONST",
+    [OP_SELF_GET_FIELD] = "SELF_GET_FIELD",
+    [OP_LOAD_RETURN] = "LOAD_RETURN",
+    [OP_STORE_AU] = "STORE_AU",
+    [OP_EQ_IF] = "EQ_IF",
+    [OP_NE_IF] = "NE_IF",
+    [OP_LT_IF] = "LT_IF",
+    [OP_LE_IF] = "LE_IF",
+    [OP_GT_IF] = "GT_IF",
+    [OP_GE_IF] = "GE_IF",
+    [OP_LOAD_LOAD_LT_IF] = "LOAD_LOAD_LT_IF",
+    [OP_MOVE] = "MOVE",
+    [OP_ADD_R] = "ADD_R",
+    [OP_SUB_R] = "SUB_R",
+    [OP_MUL_R] = "MUL_R",
+    [OP_DIV_R] = "DIV_R",
+    [OP_MOD_R] = "MOD_R",
+    [OP_EQ_R_IF] = "EQ_R_IF",
+    [OP_NE_R_IF] = "NE_R_IF",
+    [OP_LT_R_IF] = "LT_R_IF",
+    [OP_LE_R_IF] = "LE_R_IF",
+    [OP_GT_R_IF] = "GT_R_IF",
+    [OP_GE_R_IF] = "GE_R_IF",
+    [OP_GET_FIELD_IC] = "GET_FIELD_IC",
+    [OP_SET_FIELD_IC] = "SET_FIELD_IC",
+    [OP_GET_FIELD_TOP_IC] = "GET_FIELD_TOP_IC",
+    [OP_SET_FIELD_AU_IC] = "SET_FIELD_AU_IC",
+    [OP_METHOD_CALL_IC] = "METHOD_CALL_IC",
+    [OP_ADD_NUM] = "ADD_NUM",
+    [OP_SUB_NUM] = "SUB_NUM",
+    [OP_MUL_NUM] = "MUL_NUM",
+    [OP_DIV_NUM] = "DIV_NUM",
+    [OP_LT_NUM] = "LT_NUM",
+    [OP_LE_NUM] = "LE_NUM",
+    [OP_GT_NUM] = "GT_NUM",
+    [OP_GE_NUM] = "GE_NUM",
+    [OP_SELF_GET_FIELD_IC] = "SELF_GET_FIELD_IC",
+};
+
+static size_t shark_opcode_pairs[256 * 256];
+static uint8_t shark_opcode_last = OP_END;
+
+#define SHARK_PROFILE_REPORT_SIZE 48
+
+static int shark_profile_compare(const void *x, const void *y)
+{
+    size_t a = shark_opcode_pairs[*(const uint16_t *) x];
+    size_t b = shark_opcode_pairs[*(const uint16_t *) y];
+    return a < b ? 1 : a > b ? -1 : 0;
+}
+
+static void shark_profile_report(void)
+{
+    static uint16_t pairs[256 * 256];
+    size_t count = 0;
+    size_t total = 0;
+    for (size_t i = 0; i < 256 * 256; i++) {
+        size_t hits = shark_opcode_pairs[i];
+        if (hits == 0) continue;
+        pairs[count++] = (uint16_t) i;
+        total += hits;
+    }
+    qsort(pairs, count, sizeof(uint16_t), shark_profile_compare);
+    fprintf(stderr, "opcode pairs (%zu executed):\n", total);
+    for (size_t i = 0; i < count && i < SHARK_PROFILE_REPORT_SIZE; i++) {
+        const char *first = shark_opcode_name[pairs[i] >> 8];
+        const char *second = shark_opcode_name[pairs[i] & 0xFF];
+        size_t hits = shark_opcode_pairs[pairs[i]];
+        fprintf(stderr, "%10zu %6.2f%%  %s %s\n", hits, 100.0 * hits / total,
+            first ? first : "?", second ? second : "?");
+    }
+}
+
+#define PROFILE_OPCODE(op) { \
+    shark_opcode_pairs[(shark_opcode_last << 8) | op]++; \
+    shark_opcode_last = op; \
+}
+
+#endif
+
+/* The operand stack is never reallocated, so pointers into it (like the args
+** of a native function that calls back into the vm) stay valid. */
+static shark_value *shark_vm_stack_new(size_t size)
+{
+#ifdef SHARK_VM_STACK_MMAP
+    void *stack = mmap(NULL, size * sizeof(shark_value), PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (stack == MAP_FAILED) shark_memory_error();
+    return stack;
+#elif defined(SHARK_VM_STACK_VIRTUAL)
+    void *stack = VirtualAlloc(NULL, size * sizeof(shark_value), MEM_RESERVE, PAGE_NOACCESS);
+    if (stack == NULL) shark_memory_error();
+    return stack;
+#else
+    return shark_malloc(size * sizeof(shark_value));
+#endif
+}
+
+static void shark_vm_stack_free(shark_value *stack, size_t size)
+{
+#ifdef SHARK_VM_STACK_MMAP
+    munmap(stack, size * sizeof(shark_value));
+#elif defined(SHARK_VM_STACK_VIRTUAL)
+    VirtualFree(stack, 0, MEM_RELEASE);
+#else
+    shark_free(stack);
+#endif
+}
+
 SHARK_API void shark_vm_destroy(shark_object *object)
 {
     shark_vm *self = (shark_vm *) object;
     shark_object_dec_ref(self->import_path);
     shark_object_dec_ref(self->import_record);
-    shark_free(self->stack);
+    shark_object_dec_ref(self->import_listing);
+    shark_vm_stack_free(self->stack, self->stack_size);
+    shark_vm_frame_chunk *chunk = self->frame_chunk;
+    while (chunk->prev != NULL)
+        chunk = chunk->prev;
+    while (chunk != NULL) {
+        shark_vm_frame_chunk *next = chunk->next;
+        shark_free(chunk);
+        chunk = next;
+    }
 }
 
 static shark_class shark_vm_class = {
@@ -980,153 +2826,712 @@ SHARK_API shark_vm *shark_vm_new()
     shark_vm *self = shark_object_new(&shark_vm_class);
     self->import_path = shark_array_new();
     self->max_import_path = 0;
+    self->import_listing = shark_table_new();
     self->archive_record = shark_table_new();
     self->module_record = shark_table_new();
     self->import_record = shark_table_new();
     self->bottom = NULL;
+    self->frame_chunk = shark_zalloc(sizeof(shark_vm_frame_chunk));
+    self->frame_count = 0;
     self->error = NULL;
-    self->stack_size = SHARK_VM_STACK_INIT_SIZE;
+    self->method_epoch = 0;
+    self->stack_size = SHARK_VM_STACK_SIZE;
     self->TOS = 0;
-    self->stack = shark_malloc(self->stack_size * sizeof(shark_value));
+    self->stack = shark_vm_stack_new(self->stack_size);
+#ifdef SHARK_VM_STACK_VIRTUAL
+    self->stack_limit = 0;
+#else
+    self->stack_limit = self->stack_size;
+#endif
+#ifdef SHARK_JIT
+    shark_jit_init();
+#endif
+#ifdef SHARK_PROFILE_OPCODES
+    static bool report = false;
+    if (!report) atexit(shark_profile_report);
+    report = true;
+#endif
     return self;
 }
 
-SHARK_API shark_module *shark_vm_bind_module(shark_vm *vm, char *name)
+SHARK_API shark_module *shark_vm_bind_module(shark_vm *vm, char *name)
+{
+    shark_module *module = shark_object_new(&shark_module_class);
+    
+    module->name = shark_string_intern(shark_string_new_from_cstr(name));
+    module->names = shark_table_new();
+    
+    module->import_table = NULL;
+    module->const_table_size = 0;
+    module->const_table = NULL;
+    module->code = NULL;
+    module->code_size = 0;
+    module->code_map = NULL;
+    
+    module->field_cache_count = 0;
+    module->field_cache_size = 0;
+    module->field_cache = NULL;
+    module->method_cache_count = 0;
+    module->method_cache_size = 0;
+    module->method_cache = NULL;
+    
+    shark_table_set_index(vm->import_record, SHARK_FROM_PTR(module->name), SHARK_FROM_PTR(module));
+    
+    return module;
+}
+
+SHARK_API void shark_vm_register_module(shark_vm *vm, char *name, shark_module_binder bind)
+{
+    shark_native_entry *entry = shark_object_new(&shark_native_entry_class);
+    entry->bind = bind;
+    shark_string *module_name = shark_string_intern(shark_string_new_from_cstr(name));
+    shark_table_set_index(vm->module_record, SHARK_FROM_PTR(module_name), SHARK_FROM_PTR(entry));
+    shark_object_dec_ref(module_name);
+    shark_object_dec_ref(entry);
+}
+
+SHARK_API shark_class *shark_vm_bind_class(shark_vm *vm, shark_module *module, char *name, size_t object_size, void (*destroy)(shark_object *), bool is_object_class)
+{
+    shark_class *type = shark_class_new(shark_string_intern(shark_string_new_from_cstr(name)), NULL);
+    type->object_size = object_size;
+    type->destroy = destroy;
+    type->traverse = NULL;
+    type->is_object_class = is_object_class;
+    shark_table_set_index(module->names, SHARK_FROM_PTR(type->name), SHARK_FROM_PTR(type));
+    shark_object_dec_ref(type);
+    return type;
+}
+
+SHARK_API shark_function *shark_vm_bind_function(shark_vm *vm, shark_module *module, shark_class *type, char *name, size_t arity, shark_native_function code)
+{
+    shark_function *function = shark_object_new(&shark_function_class);
+    
+    function->arity = arity;
+    function->name = shark_string_intern(shark_string_new_from_cstr(name));
+    
+    if (type != NULL) {
+        function->is_method = true;
+        function->owner_class = shark_object_inc_ref(type);
+        function->supermethod = shark_object_inc_ref(SHARK_AS_OBJECT(
+            shark_table_get_index(type->methods, SHARK_FROM_PTR(function->name))));
+        shark_table_set_index(type->methods,
+            SHARK_FROM_PTR(function->name), SHARK_FROM_PTR(function));
+        vm->method_epoch++;
+    } else {
+        function->is_method = false;
+        function->owner_class = NULL;
+        function->supermethod = NULL;
+        shark_table_set_index(module->names,
+            SHARK_FROM_PTR(function->name), SHARK_FROM_PTR(function));
+    }
+    
+    function->owner = shark_object_inc_ref(module);
+    function->type = SHARK_NATIVE_FUNCTION;
+    function->code.native_code = code;
+    function->code_size = 0;
+    
+    return function;
+}
+
+SHARK_API void shark_vm_add_import_path(shark_vm *self, shark_string *import_path)
+{
+    shark_array_put(self->import_path, SHARK_FROM_PTR(import_path));
+    if (import_path->size > self->max_import_path)
+        self->max_import_path = import_path->size;
+}
+
+SHARK_API shark_module *shark_vm_import_module(shark_vm *self, shark_string *name)
+{
+    if (shark_table_contains(self->import_record, SHARK_FROM_PTR(name)))
+        return SHARK_AS_MODULE(shark_table_get_index(self->import_record, SHARK_FROM_PTR(name)));
+    
+    shark_module *module = shark_vm_find_module(self, name);
+    
+    if (module == NULL)
+    {
+        fprintf(stderr, "missing module '%s', execution aborted.", name->data);
+        shark_print_stack_trace(self);
+        exit(EXIT_FAILURE);
+    }
+    
+    /* native modules are in the import record as soon as they're bound */
+    if (shark_table_contains(self->import_record, SHARK_FROM_PTR(name)))
+        return module;
+    
+    shark_table_set_index(self->import_record, SHARK_FROM_PTR(name), SHARK_FROM_PTR(module));
+    shark_vm_exec_module(self, module);
+    
+    return module;
+}
+
+/* Bytecode never pushes more than one value per byte of code, so whatever a
+** call does fits on the stack if code_size slots are free when it starts.
+** That's checked once on entry instead of on every push. */
+#define SHARK_VM_CHECK_STACK(vm, size) \
+    if ((vm)->TOS + (size) > (vm)->stack_limit) \
+        shark_vm_stack_reach(vm, (vm)->TOS + (size));
+
+#define SHARK_VM_STACK_COMMIT_SIZE  4096
+
+/* Makes the stack usable up to 'top'. Only a reserved stack (VirtualAlloc)
+** has a limit short of its size, it's committed at least twice as far each
+** time the limit is reached. */
+static void shark_vm_stack_reach(shark_vm *vm, size_t top)
+{
+    if (top > vm->stack_size)
+        shark_fatal_error(vm, "stack overflow.");
+#ifdef SHARK_VM_STACK_VIRTUAL
+    size_t limit = vm->stack_limit * 2;
+    if (limit < SHARK_VM_STACK_COMMIT_SIZE) limit = SHARK_VM_STACK_COMMIT_SIZE;
+    if (limit < top) limit = top;
+    if (limit > vm->stack_size) limit = vm->stack_size;
+    if (VirtualAlloc(vm->stack, limit * sizeof(shark_value), MEM_COMMIT, PAGE_READWRITE) == NULL)
+        shark_memory_error();
+    vm->stack_limit = limit;
+#endif
+}
+
+/* Frees whatever is flagged in the zero count table with no references left.
+** Objects freed here release theirs and get appended to the table, which is
+** walked until it's done. The ones that survive were only on the stack when
+** they got there, nothing decremented them since, so they may be part of a
+** cycle and are buffered as roots. A candidate root can't be freed while the buffer
+** points to it, it's left there with no count and the buffer is compacted
+** afterwards (the ones that reach zero meanwhile are in the table again and
+** wait for the next round). */
+static void shark_zct_flush()
+{
+    do {
+        bool released = false;
+        for (size_t i = 0; i < shark_zct_count; i++) {
+            shark_object *object = shark_zct[i];
+            if (object->ref_count & SHARK_REF_COUNT_MASK) {
+                object->ref_count &= ~SHARK_ZCT_FLAG;
+                if (!(object->ref_count & SHARK_GC_BUFFERED) && object->type->traverse != NULL) {
+                    object->ref_count |= SHARK_GC_BUFFERED;
+                    shark_gc_add(object);
+                }
+            } else if (object->ref_count & SHARK_GC_BUFFERED) {
+                object->ref_count = SHARK_GC_BUFFERED;
+                released = true;
+            } else {
+                shark_object_delete(object);
+            }
+        }
+        shark_zct_count = 0;
+        if (!released) break;
+        size_t count = 0;
+        for (size_t i = 0; i < shark_gc_count; i++) {
+            shark_object *object = shark_gc_roots[i];
+            if (object->ref_count != SHARK_GC_BUFFERED)
+                shark_gc_roots[count++] = object;
+            else
+                shark_object_delete(object);
+        }
+        shark_gc_count = count;
+    } while (shark_zct_count != 0);
+}
+
+/* The collector walks the object graph with a stack of its own, so deep
+** structures don't overflow the C stack. After the white pass it holds the
+** garbage instead. */
+static shark_object **shark_gc_stack = NULL;
+static size_t shark_gc_stack_count = 0;
+static size_t shark_gc_stack_size = 0;
+static size_t shark_gc_traced = 0;
+
+static void shark_gc_push(shark_object *object)
+{
+    if (shark_gc_stack_count == shark_gc_stack_size) {
+        shark_gc_stack_size = shark_gc_stack_size == 0 ? SHARK_GC_THRESHOLD : shark_gc_stack_size << 1;
+        shark_gc_stack = shark_realloc(shark_gc_stack, shark_gc_stack_size * sizeof(shark_object *));
+    }
+    shark_gc_stack[shark_gc_stack_count++] = object;
+}
+
+#define SHARK_GC_SET_COLOR(object, color) \
+    ((object)->ref_count = ((object)->ref_count & ~SHARK_GC_COLOR) | (color))
+
+#define SHARK_GC_TRAVERSE(object, visit) \
+    if ((object)->type->traverse != NULL) (object)->type->traverse(object, visit);
+
+/* objects can hold null pointers to objects, the visitors skip those */
+static void shark_gc_visit_gray(shark_object *object)
+{
+    if (object == NULL) return;
+    object->ref_count--;
+    if (!(object->ref_count & SHARK_GC_GRAY)) {
+        SHARK_GC_SET_COLOR(object, SHARK_GC_GRAY);
+        shark_gc_push(object);
+        shark_gc_traced++;
+    }
+}
+
+static void shark_gc_visit_black(shark_object *object)
+{
+    if (object == NULL) return;
+    object->ref_count++;
+    if (object->ref_count & SHARK_GC_COLOR) {
+        SHARK_GC_SET_COLOR(object, 0);
+        shark_gc_push(object);
+    }
+}
+
+static void shark_gc_visit_scan(shark_object *object)
+{
+    if (object != NULL) shark_gc_push(object);
+}
+
+/* the garbage is buffered, so this only gives back what the gray pass took
+** from the objects that survive, their destructors take it again */
+static void shark_gc_visit_restore(shark_object *object)
+{
+    if (object != NULL && !(object->ref_count & SHARK_GC_BUFFERED))
+        object->ref_count++;
+}
+
+static void shark_gc_visit_white(shark_object *object)
+{
+    if (object != NULL && (object->ref_count & SHARK_GC_COLOR) == SHARK_GC_WHITE) {
+        /* black, and with a count the garbage can't take to zero */
+        object->ref_count = SHARK_GC_BUFFERED | (SHARK_REF_COUNT_MASK >> 1)
+            | (object->ref_count & SHARK_STRING_INTERNED);
+        shark_gc_push(object);
+    }
+}
+
+/* Subtracts the references among everything reachable from the roots. The
+** objects that still have some are referenced from outside (or the stack),
+** they and whatever they reach get their counts back. The rest is garbage. */
+static size_t shark_gc_collect()
+{
+    shark_gc_traced = 0;
+    for (size_t i = 0; i < shark_gc_count; i++) {
+        shark_object *root = shark_gc_roots[i];
+        if (root->ref_count & SHARK_GC_GRAY) continue;
+        SHARK_GC_SET_COLOR(root, SHARK_GC_GRAY);
+        shark_gc_push(root);
+        shark_gc_traced++;
+        while (shark_gc_stack_count != 0) {
+            shark_object *object = shark_gc_stack[--shark_gc_stack_count];
+            SHARK_GC_TRAVERSE(object, shark_gc_visit_gray);
+        }
+    }
+    for (size_t i = 0; i < shark_gc_count; i++) {
+        shark_gc_push(shark_gc_roots[i]);
+        while (shark_gc_stack_count != 0) {
+            shark_object *object = shark_gc_stack[--shark_gc_stack_count];
+            if ((object->ref_count & SHARK_GC_COLOR) != SHARK_GC_GRAY)
+                continue;
+            if (object->ref_count & SHARK_REF_COUNT_MASK) {
+                size_t base = shark_gc_stack_count;
+                SHARK_GC_SET_COLOR(object, 0);
+                SHARK_GC_TRAVERSE(object, shark_gc_visit_black);
+                while (shark_gc_stack_count != base) {
+                    shark_object *next = shark_gc_stack[--shark_gc_stack_count];
+                    SHARK_GC_TRAVERSE(next, shark_gc_visit_black);
+                }
+            } else {
+                SHARK_GC_SET_COLOR(object, SHARK_GC_WHITE);
+                SHARK_GC_TRAVERSE(object, shark_gc_visit_scan);
+            }
+        }
+    }
+    for (size_t i = 0; i < shark_gc_count; i++)
+        shark_gc_roots[i]->ref_count &= ~SHARK_GC_BUFFERED;
+    for (size_t i = 0; i < shark_gc_count; i++)
+        shark_gc_visit_white(shark_gc_roots[i]);
+    shark_gc_count = 0;
+    for (size_t i = 0; i < shark_gc_stack_count; i++)
+        SHARK_GC_TRAVERSE(shark_gc_stack[i], shark_gc_visit_white);
+    /* every destructor runs before anything is freed, the garbage still
+    ** points to itself */
+    size_t collected = shark_gc_stack_count;
+    for (size_t i = 0; i < collected; i++)
+        SHARK_GC_TRAVERSE(shark_gc_stack[i], shark_gc_visit_restore);
+    for (size_t i = 0; i < collected; i++)
+        shark_gc_stack[i]->type->destroy(shark_gc_stack[i]);
+    for (size_t i = 0; i < collected; i++)
+        shark_free(shark_gc_stack[i]);
+    shark_gc_stack_count = 0;
+    shark_gc.collections++;
+    shark_gc.collected += collected;
+    /* a collection traces the live objects it reaches as well, so wait for
+    ** more roots before the next one when there were many */
+    if (shark_gc.threshold != 0)
+        shark_gc_limit = shark_gc.threshold + (shark_gc_traced - collected) / 2;
+    return collected;
+}
+
+#undef SHARK_GC_SET_COLOR
+#undef SHARK_GC_TRAVERSE
+
+SHARK_API shark_gc_stats shark_gc_get_stats()
+{
+    shark_gc.roots = shark_gc_count;
+    return shark_gc;
+}
+
+/* A threshold of zero turns automatic collection off. */
+SHARK_API void shark_gc_set_threshold(size_t threshold)
+{
+    shark_gc.threshold = threshold;
+    shark_gc_limit = threshold == 0 ? SIZE_MAX : threshold;
+}
+
+/* Counts the references from the stack for a moment, so whatever is still
+** flagged with no references left is garbage and the stack is a root for
+** the cycle collector. The ones only the stack keeps alive end up back in
+** the table when the stack references are taken away again. */
+static size_t shark_vm_reconcile_stack(shark_vm *self, bool collect)
+{
+    for (size_t i = 0; i < self->TOS; i++)
+        shark_value_inc_ref(self->stack[i]);
+    shark_zct_flush();
+    size_t collected = 0;
+    if (collect) {
+        collected = shark_gc_collect();
+        shark_zct_flush();
+    }
+    /* not shark_value_dec_ref, that would buffer them all as roots */
+    for (size_t i = 0; i < self->TOS; i++) {
+        shark_object *object = SHARK_IS_OBJECT(self->stack[i]) ? SHARK_AS_OBJECT(self->stack[i]) : NULL;
+        if (object != NULL && !(--object->ref_count & SHARK_REF_COUNT_MASK) && !(object->ref_count & SHARK_ZCT_FLAG)) {
+            object->ref_count |= SHARK_ZCT_FLAG;
+            shark_zct_add(object);
+        }
+    }
+    /* the stack is walked every time, so keep that cost proportional */
+    shark_zct_limit = shark_zct_count
+        + (self->TOS > SHARK_ZCT_INIT_SIZE ? self->TOS : SHARK_ZCT_INIT_SIZE);
+    return collected;
+}
+
+SHARK_API void shark_vm_reconcile(shark_vm *self)
+{
+    shark_vm_reconcile_stack(self, shark_gc_count >= shark_gc_limit);
+}
+
+SHARK_API size_t shark_vm_collect(shark_vm *self)
+{
+    return shark_vm_reconcile_stack(self, true);
+}
+
+/* Safepoints are where every live value is on the stack: calls, returns and
+** loop back edges. */
+#define SHARK_VM_SAFEPOINT(vm) \
+    if (shark_zct_count >= shark_zct_limit || shark_gc_count >= shark_gc_limit) \
+        shark_vm_reconcile(vm);
+
+static shark_vm_frame *shark_vm_push_frame(shark_vm *self)
 {
-    shark_module *module = shark_object_new(&shark_module_class);
-    
-    module->name = shark_string_new_from_cstr(name);
-    module->names = shark_table_new();
-    
-    module->import_table = NULL;
-    module->const_table_size = 0;
-    module->const_table = NULL;
-    module->code = NULL;
-    
-    shark_table_set_index(vm->import_record, SHARK_FROM_PTR(module->name), SHARK_FROM_PTR(module));
-    
-    return module;
+    if (self->frame_count == SHARK_VM_FRAME_CHUNK_SIZE) {
+        if (self->frame_chunk->next == NULL) {
+            shark_vm_frame_chunk *chunk = shark_malloc(sizeof(shark_vm_frame_chunk));
+            chunk->prev = self->frame_chunk;
+            chunk->next = NULL;
+            self->frame_chunk->next = chunk;
+        }
+        self->frame_chunk = self->frame_chunk->next;
+        self->frame_count = 0;
+    }
+    return &self->frame_chunk->frames[self->frame_count++];
 }
 
-SHARK_API shark_class *shark_vm_bind_class(shark_vm *vm, shark_module *module, char *name, size_t object_size, void (*destroy)(shark_object *), bool is_object_class)
+static void shark_vm_pop_frame(shark_vm *self)
 {
-    shark_class *type = shark_class_new(shark_string_new_from_cstr(name), NULL);
-    type->object_size = object_size;
-    type->destroy = destroy;
-    type->is_object_class = is_object_class;
-    shark_table_set_index(module->names, SHARK_FROM_PTR(type->name), SHARK_FROM_PTR(type));
-    shark_object_dec_ref(type);
-    return type;
+    if (--self->frame_count == 0 && self->frame_chunk->prev != NULL) {
+        self->frame_chunk = self->frame_chunk->prev;
+        self->frame_count = SHARK_VM_FRAME_CHUNK_SIZE;
+    }
 }
 
-SHARK_API shark_function *shark_vm_bind_function(shark_vm *vm, shark_module *module, shark_class *type, char *name, size_t arity, shark_native_function code)
+/* Rewrites a field access instruction into its inline cached form. The
+** constant index operand at 'operand' is replaced with the index of a fresh
+** cache entry in the module that owns the code. Returns false (and leaves
+** the instruction alone) once the module runs out of cache entries. */
+static bool shark_vm_quicken_field(shark_module *module, uint8_t *inst, uint8_t *operand, uint8_t opcode)
 {
-    shark_function *function = shark_object_new(&shark_function_class);
-    
-    function->arity = arity;
-    function->name = shark_string_new_from_cstr(name);
+    if (module->field_cache_count >= SHARK_FIELD_CACHE_MAX)
+        return false;
     
-    if (type != NULL) {
-        function->is_method = true;
-        function->owner_class = shark_object_inc_ref(type);
-        function->supermethod = shark_object_inc_ref(SHARK_AS_OBJECT(
-            shark_table_get_index(type->methods, SHARK_FROM_PTR(function->name))));
-        shark_table_set_index(type->methods,
-            SHARK_FROM_PTR(function->name), SHARK_FROM_PTR(function));
-    } else {
-        function->is_method = false;
-        function->owner_class = NULL;
-        function->supermethod = NULL;
-        shark_table_set_index(module->names,
-            SHARK_FROM_PTR(function->name), SHARK_FROM_PTR(function));
+    if (module->field_cache_count == module->field_cache_size)
+    {
+        module->field_cache_size = module->field_cache_size == 0
+            ? SHARK_FIELD_CACHE_INIT_SIZE : module->field_cache_size << 1;
+        module->field_cache = shark_realloc(module->field_cache,
+            module->field_cache_size * sizeof(shark_field_cache));
     }
     
-    function->owner = shark_object_inc_ref(module);
-    function->type = SHARK_NATIVE_FUNCTION;
-    function->code.native_code = code;
+    size_t index = module->field_cache_count++;
+    uint16_t const_index = ((uint16_t) operand[0]) | (((uint16_t) operand[1]) << 8);
     
-    return function;
-}
-
-SHARK_API void shark_vm_add_import_path(shark_vm *self, shark_string *import_path)
-{
-    shark_array_put(self->import_path, SHARK_FROM_PTR(import_path));
-    if (import_path->size > self->max_import_path)
-        self->max_import_path = import_path->size;
+    module->field_cache[index].name = module->const_table[const_index];
+    module->field_cache[index].key = SHARK_NULL;
+    module->field_cache[index].slot = 0;
+    module->field_cache[index].shape = NULL;
+    module->field_cache[index].next = NULL;
+    module->field_cache[index].index = 0;
+    
+    inst[0] = opcode;
+    operand[0] = (uint8_t) index;
+    operand[1] = (uint8_t) (index >> 8);
+    
+    return true;
 }
 
-SHARK_API shark_module *shark_vm_import_module(shark_vm *self, shark_string *name)
+/* Same as shark_vm_quicken_field, for method calls. */
+static bool shark_vm_quicken_method(shark_module *module, uint8_t *inst, uint8_t *operand, uint8_t opcode)
 {
-    if (shark_table_contains(self->import_record, SHARK_FROM_PTR(name)))
-        return SHARK_AS_MODULE(shark_table_get_index(self->import_record, SHARK_FROM_PTR(name)));
+    if (module->method_cache_count >= SHARK_METHOD_CACHE_MAX)
+        return false;
     
-    if (!shark_table_contains(self->module_record, SHARK_FROM_PTR(name)))
+    if (module->method_cache_count == module->method_cache_size)
     {
-        fprintf(stderr, "missing module '%s', execution aborted.", name->data);
-        shark_print_stack_trace(self);
-        exit(EXIT_FAILURE);
+        module->method_cache_size = module->method_cache_size == 0
+            ? SHARK_METHOD_CACHE_INIT_SIZE : module->method_cache_size << 1;
+        module->method_cache = shark_realloc(module->method_cache,
+            module->method_cache_size * sizeof(shark_method_cache));
     }
     
-    shark_module *module = SHARK_AS_MODULE(shark_table_get_index(self->module_record, SHARK_FROM_PTR(name)));
-    shark_table_set_index(self->import_record, SHARK_FROM_PTR(name), SHARK_FROM_PTR(module));
-    shark_vm_exec_module(self, module);
+    size_t index = module->method_cache_count++;
+    uint16_t const_index = ((uint16_t) operand[0]) | (((uint16_t) operand[1]) << 8);
     
-    return module;
+    shark_method_cache *cache = &module->method_cache[index];
+    memset(cache, 0, sizeof(shark_method_cache));
+    cache->name = module->const_table[const_index];
+    
+    inst[0] = opcode;
+    operand[0] = (uint8_t) index;
+    operand[1] = (uint8_t) (index >> 8);
+    
+    return true;
+}
+
+static inline shark_function *shark_method_cache_lookup(shark_vm *vm, shark_method_cache *cache, shark_class *type)
+{
+    if (cache->epoch == vm->method_epoch)
+        for (size_t i = 0; i < SHARK_METHOD_CACHE_WAYS; i++)
+            if (cache->type[i] == type)
+                return cache->method[i];
+    return NULL;
 }
 
-static void shark_vm_grow_stack(shark_vm *self)
+/* Entries from an older epoch are dropped, otherwise the ways are refilled
+** round robin once the site has seen more than SHARK_METHOD_CACHE_WAYS
+** receiver classes. */
+static void shark_method_cache_fill(shark_vm *vm, shark_method_cache *cache, shark_class *type, shark_function *method)
 {
-    size_t new_stack_size = SHARK_VM_STACK_GROW_SIZE(self->stack_size);
-    shark_value *new_stack = shark_malloc(new_stack_size * sizeof(shark_value));
-    memcpy(new_stack, self->stack, self->stack_size * sizeof(shark_value));
-    shark_free(self->stack);
-    self->stack_size = new_stack_size;
-    self->stack = new_stack;
+    if (cache->epoch != vm->method_epoch) {
+        shark_method_cache_clear(cache);
+        cache->epoch = vm->method_epoch;
+    }
+    size_t way = cache->next;
+    cache->next = (way + 1) % SHARK_METHOD_CACHE_WAYS;
+    shark_object_dec_ref(cache->type[way]);
+    shark_object_dec_ref(cache->method[way]);
+    cache->type[way] = shark_object_inc_ref(type);
+    cache->method[way] = shark_object_inc_ref(method);
 }
 
+#ifdef SHARK_JIT
+#include "cshark_jit.c"
+#endif
+
+/* Threaded dispatch: when the compiler supports labels as values (GCC, Clang)
+** every handler jumps straight to the next one through a label table indexed
+** by opcode, instead of going back through the shared switch. Define
+** SHARK_NO_COMPUTED_GOTO to force the portable switch. */
+#if !defined(SHARK_NO_COMPUTED_GOTO) && !defined(SHARK_PROFILE_OPCODES) \
+    && (defined(__GNUC__) || defined(__clang__))
+    #define SHARK_COMPUTED_GOTO
+#endif
+
 SHARK_API shark_value shark_vm_execute(shark_vm *self, shark_vm_frame *prev, shark_module *module, shark_function *code)
 {
-    shark_vm_frame frame;
+    shark_vm_frame *frame = shark_vm_push_frame(self);
+    shark_value result;
     
-    frame.parent = prev;
-    frame.module = module;
-    frame.function = code;
-    frame.globals = module->names;
-    frame.const_table = module->const_table;
+    frame->parent = prev;
+    frame->module = module;
+    frame->function = code;
+    frame->globals = module->names;
+    frame->const_table = module->const_table;
     
     if (code != NULL) {
-        frame.base = self->TOS - code->arity - (code->is_method ? 1 : 0);
-        frame.code = code->code.bytecode;
+        frame->base = self->TOS - code->arity - (code->is_method ? 1 : 0);
+        frame->code = code->code.bytecode;
     } else {
-        frame.base = self->TOS;
-        frame.code = module->code;
+        frame->base = self->TOS;
+        frame->code = module->code;
     }
+    frame->call = SHARK_CALL_ENTRY;
+    SHARK_VM_CHECK_STACK(self, code != NULL ? code->code_size : module->code_size);
     
-#define FETCH           (*(frame.code++))
-
-#define FETCH_SHORT     (((uint16_t) FETCH) \
-                        | (((uint16_t) FETCH) << 8))
-
-#define FETCH_INT       (((uint32_t) FETCH) \
-                        | (((uint32_t) FETCH) << 8) \
-                        | (((uint32_t) FETCH) << 16) \
-                        | (((uint32_t) FETCH) << 24))
-
-#define PUSH(value) { \
-                    shark_value __PUSH_VALUE__ = value; \
-                    self->stack[self->TOS++] = __PUSH_VALUE__; \
-                    shark_value_inc_ref(__PUSH_VALUE__); \
-                    if (self->TOS == self->stack_size) \
-                        shark_vm_grow_stack(self); \
-                }
+#define FETCH           (*(frame->code++))
+
+/* multi-byte operands are read before the code pointer moves past them,
+** advancing it once per byte in the same expression is unsequenced */
+#define FETCH_SHORT     (frame->code += 2, \
+                        ((uint16_t) frame->code[-2]) \
+                        | (((uint16_t) frame->code[-1]) << 8))
+
+#define FETCH_INT       (frame->code += 4, \
+                        ((uint32_t) frame->code[-4]) \
+                        | (((uint32_t) frame->code[-3]) << 8) \
+                        | (((uint32_t) frame->code[-2]) << 16) \
+                        | (((uint32_t) frame->code[-1]) << 24))
+
+#define PUSH(value)     (self->stack[self->TOS++] = (value))
 
 #define POP         self->stack[--self->TOS]
 
-#define CONST   (frame.const_table[FETCH_SHORT])
+#define CONST   (frame->const_table[FETCH_SHORT])
 
 #define DEC_REF(x)  shark_object_dec_ref(SHARK_AS_OBJECT(x))
+
+#define FIELD_CACHE (&frame->module->field_cache[FETCH_SHORT])
+
+#ifdef SHARK_COMPUTED_GOTO
+    static void *dispatch_table[256] = {
+        [0 ... 255] = &&op_label_unknown,
+        [OP_END] = &&op_label_OP_END,
+        [OP_NULL] = &&op_label_OP_NULL,
+        [OP_TRUE] = &&op_label_OP_TRUE,
+        [OP_FALSE] = &&op_label_OP_FALSE,
+        [OP_LOAD_GLOBAL] = &&op_label_OP_LOAD_GLOBAL,
+        [OP_LOAD] = &&op_label_OP_LOAD,
+        [OP_GET_FIELD] = &&op_label_OP_GET_FIELD,
+        [OP_ENTER_CLASS] = &&op_label_OP_ENTER_CLASS,
+        [OP_EXIT_CLASS] = &&op_label_OP_EXIT_CLASS,
+        [OP_DEFINE] = &&op_label_OP_DEFINE,
+        [OP_DEFINE_FIELD] = &&op_label_OP_DEFINE_FIELD,
+        [OP_FUNCTION] = &&op_label_OP_FUNCTION,
+        [OP_NOT_IMPLEMENTED] = &&op_label_OP_NOT_IMPLEMENTED,
+        [OP_EXIT] = &&op_label_OP_EXIT,
+        [OP_DUP] = &&op_label_OP_DUP,
+        [OP_DROP] = &&op_label_OP_DROP,
+        [OP_SWAP] = &&op_label_OP_SWAP,
+        [OP_MUL] = &&op_label_OP_MUL,
+        [OP_DIV] = &&op_label_OP_DIV,
+        [OP_MOD] = &&op_label_OP_MOD,
+        [OP_ADD] = &&op_label_OP_ADD,
+        [OP_SUB] = &&op_label_OP_SUB,
+        [OP_LT] = &&op_label_OP_LT,
+        [OP_LE] = &&op_label_OP_LE,
+        [OP_GT] = &&op_label_OP_GT,
+        [OP_GE] = &&op_label_OP_GE,
+        [OP_EQ] = &&op_label_OP_EQ,
+        [OP_NE] = &&op_label_OP_NE,
+        [OP_IN] = &&op_label_OP_IN,
+        [OP_NOT_IN] = &&op_label_OP_NOT_IN,
+        [OP_NEG] = &&op_label_OP_NEG,
+        [OP_NOT] = &&op_label_OP_NOT,
+        [OP_FUNCTION_CALL] = &&op_label_OP_FUNCTION_CALL,
+        [OP_METHOD_CALL] = &&op_label_OP_METHOD_CALL,
+        [OP_GET_INDEX] = &&op_label_OP_GET_INDEX,
+        [OP_SELF] = &&op_label_OP_SELF,
+        [OP_SUPER_CALL] = &&op_label_OP_SUPER_CALL,
+        [OP_SIZEOF] = &&op_label_OP_SIZEOF,
+        [OP_NEW] = &&op_label_OP_NEW,
+        [OP_INSTANCEOF] = &&op_label_OP_INSTANCEOF,
+        [OP_ARRAY_NEW] = &&op_label_OP_ARRAY_NEW,
+        [OP_ARRAY_NEW_APPEND] = &&op_label_OP_ARRAY_NEW_APPEND,
+        [OP_TABLE_NEW] = &&op_label_OP_TABLE_NEW,
+        [OP_TABLE_NEW_INSERT] = &&op_label_OP_TABLE_NEW_INSERT,
+        [OP_CONST] = &&op_label_OP_CONST,
+        [OP_RETURN] = &&op_label_OP_RETURN,
+        [OP_INSERT] = &&op_label_OP_INSERT,
+        [OP_APPEND] = &&op_label_OP_APPEND,
+        [OP_STORE_GLOBAL] = &&op_label_OP_STORE_GLOBAL,
+        [OP_STORE] = &&op_label_OP_STORE,
+        [OP_SET_STATIC] = &&op_label_OP_SET_STATIC,
+        [OP_SET_FIELD] = &&op_label_OP_SET_FIELD,
+        [OP_SET_INDEX] = &&op_label_OP_SET_INDEX,
+        [OP_GET_FIELD_TOP] = &&op_label_OP_GET_FIELD_TOP,
+        [OP_GET_INDEX_TOP] = &&op_label_OP_GET_INDEX_TOP,
+        [OP_GET_STATIC] = &&op_label_OP_GET_STATIC,
+        [OP_GET_STATIC_TOP] = &&op_label_OP_GET_STATIC_TOP,
+        [OP_IF] = &&op_label_OP_IF,
+        [OP_JUMP] = &&op_label_OP_JUMP,
+        [OP_LOOP] = &&op_label_OP_LOOP,
+        [OP_ZERO] = &&op_label_OP_ZERO,
+        [OP_INC] = &&op_label_OP_INC,
+        [OP_OR] = &&op_label_OP_OR,
+        [OP_AND] = &&op_label_OP_AND,
+        [OP_SET_INDEX_AU] = &&op_label_OP_SET_INDEX_AU,
+        [OP_SET_FIELD_AU] = &&op_label_OP_SET_FIELD_AU,
+        [OP_SET_STATIC_AU] = &&op_label_OP_SET_STATIC_AU,
+        [OP_ARRAY_CLOSE] = &&op_label_OP_ARRAY_CLOSE,
+        [OP_TABLE_CLOSE] = &&op_label_OP_TABLE_CLOSE,
+        [OP_BAND] = &&op_label_OP_BAND,
+        [OP_BOR] = &&op_label_OP_BOR,
+        [OP_BXOR] = &&op_label_OP_BXOR,
+        [OP_BSHL] = &&op_label_OP_BSHL,
+        [OP_BSHR] = &&op_label_OP_BSHR,
+        [OP_BNOT] = &&op_label_OP_BNOT,
+        [OP_GET_FIELD_IC] = &&op_label_OP_GET_FIELD_IC,
+        [OP_SET_FIELD_IC] = &&op_label_OP_SET_FIELD_IC,
+        [OP_GET_FIELD_TOP_IC] = &&op_label_OP_GET_FIELD_TOP_IC,
+        [OP_SET_FIELD_AU_IC] = &&op_label_OP_SET_FIELD_AU_IC,
+        [OP_METHOD_CALL_IC] = &&op_label_OP_METHOD_CALL_IC,
+        [OP_ADD_NUM] = &&op_label_OP_ADD_NUM,
+        [OP_SUB_NUM] = &&op_label_OP_SUB_NUM,
+        [OP_MUL_NUM] = &&op_label_OP_MUL_NUM,
+        [OP_DIV_NUM] = &&op_label_OP_DIV_NUM,
+        [OP_LT_NUM] = &&op_label_OP_LT_NUM,
+        [OP_LE_NUM] = &&op_label_OP_LE_NUM,
+        [OP_GT_NUM] = &&op_label_OP_GT_NUM,
+        [OP_GE_NUM] = &&op_label_OP_GE_NUM,
+        [OP_LOAD_LOAD] = &&op_label_OP_LOAD_LOAD,
+        [OP_LOAD_CONST] = &&op_label_OP_LOAD_CONST,
+        [OP_SELF_GET_FIELD] = &&op_label_OP_SELF_GET_FIELD,
+        [OP_SELF_GET_FIELD_IC] = &&op_label_OP_SELF_GET_FIELD_IC,
+        [OP_LOAD_RETURN] = &&op_label_OP_LOAD_RETURN,
+        [OP_STORE_AU] = &&op_label_OP_STORE_AU,
+        [OP_EQ_IF] = &&op_label_OP_EQ_IF,
+        [OP_NE_IF] = &&op_label_OP_NE_IF,
+        [OP_LT_IF] = &&op_label_OP_LT_IF,
+        [OP_LE_IF] = &&op_label_OP_LE_IF,
+        [OP_GT_IF] = &&op_label_OP_GT_IF,
+        [OP_GE_IF] = &&op_label_OP_GE_IF,
+        [OP_LOAD_LOAD_LT_IF] = &&op_label_OP_LOAD_LOAD_LT_IF,
+        [OP_MOVE] = &&op_label_OP_MOVE,
+        [OP_ADD_R] = &&op_label_OP_ADD_R,
+        [OP_SUB_R] = &&op_label_OP_SUB_R,
+        [OP_MUL_R] = &&op_label_OP_MUL_R,
+        [OP_DIV_R] = &&op_label_OP_DIV_R,
+        [OP_MOD_R] = &&op_label_OP_MOD_R,
+        [OP_EQ_R_IF] = &&op_label_OP_EQ_R_IF,
+        [OP_NE_R_IF] = &&op_label_OP_NE_R_IF,
+        [OP_LT_R_IF] = &&op_label_OP_LT_R_IF,
+        [OP_LE_R_IF] = &&op_label_OP_LE_R_IF,
+        [OP_GT_R_IF] = &&op_label_OP_GT_R_IF,
+        [OP_GE_R_IF] = &&op_label_OP_GE_R_IF,
+    };
+#define CASE(op)    case op: op_label_ ## op
+#define DEFAULT     default: op_label_unknown
+#define NEXT        goto *dispatch_table[FETCH]
+#else
+#define CASE(op)    case op
+#define DEFAULT     default
+#define NEXT        break
+#endif
+
+#define QUICKEN_FIELD(opcode, offset) \
+    if (shark_vm_quicken_field(frame->module, frame->code - 1, frame->code + offset, opcode)) { \
+        frame->code--; \
+        NEXT; \
+    }
+    
+    self->bottom = frame;
     
-    self->bottom = &frame;
+#ifdef SHARK_JIT
+    if (code != NULL && shark_jit_enter(self, frame, frame->code, &result)) {
+        shark_vm_pop_frame(self);
+        return shark_value_inc_ref(result);
+    }
+#endif
     
     shark_class *current_class = NULL;
     shark_array *current_array = NULL;
@@ -1136,39 +3541,64 @@ SHARK_API shark_value shark_vm_execute(shark_vm *self, shark_vm_frame *prev, sha
     {
     	uint8_t inst = FETCH;
         // printf("inst %d\n", inst);
+#ifdef SHARK_PROFILE_OPCODES
+        PROFILE_OPCODE(inst);
+#endif
         switch (inst)
         {
-        case OP_END:
+        CASE(OP_END):
 end:
-            for (size_t i = self->TOS; i > frame.base; i--)
-                shark_value_dec_ref(POP);
-            // TODO: shrink stack
-            return SHARK_NULL;
-        case OP_NULL:
+            self->TOS = frame->base;
+            result = SHARK_NULL;
+call_return: {
+            shark_vm_call call = frame->call;
+            frame = frame->parent;
+            shark_vm_pop_frame(self);
+            /* C callers get a reference, like from a native function */
+            if (call == SHARK_CALL_ENTRY)
+                return shark_value_inc_ref(result);
+            if (call == SHARK_CALL_FUNCTION)
+                self->TOS--;
+            if (call != SHARK_CALL_NEW)
+                PUSH(result);
+            self->bottom = frame;
+            if (self->error->message != NULL) goto end;
+            SHARK_VM_SAFEPOINT(self);
+            NEXT;
+        }
+        CASE(OP_NULL):
             PUSH(SHARK_NULL);
-            break;
-        case OP_TRUE:
+            NEXT;
+        CASE(OP_TRUE):
             PUSH(SHARK_TRUE);
-            break;
-        case OP_FALSE:
+            NEXT;
+        CASE(OP_FALSE):
             PUSH(SHARK_FALSE);
-            break;
-        case OP_LOAD_GLOBAL:
-            PUSH(shark_table_get_index(frame.globals, CONST));
-            break;
-        case OP_LOAD:
-            PUSH(self->stack[frame.base + FETCH]);
-            break;
-        case OP_GET_FIELD: {
+            NEXT;
+        CASE(OP_LOAD_GLOBAL):
+            PUSH(shark_table_get_index(frame->globals, CONST));
+            NEXT;
+        CASE(OP_LOAD):
+            PUSH(self->stack[frame->base + FETCH]);
+            NEXT;
+        CASE(OP_GET_FIELD): {
+            QUICKEN_FIELD(OP_GET_FIELD_IC, 0);
             shark_value object = POP;
             if (!SHARK_IS_OBJECT(object)
             || !SHARK_AS_OBJECT(object)->type->is_object_class)
                 shark_fatal_error(self, "can't get field of a non-object.");
             PUSH(shark_table_get_index(SHARK_AS_TABLE(object), CONST));
-            DEC_REF(object);
-            break;
+            NEXT;
+        }
+        CASE(OP_GET_FIELD_IC): {
+            shark_value object = POP;
+            if (!SHARK_IS_OBJECT(object)
+            || !SHARK_AS_OBJECT(object)->type->is_object_class)
+                shark_fatal_error(self, "can't get field of a non-object.");
+            PUSH(shark_table_get_cached(SHARK_AS_TABLE(object), FIELD_CACHE));
+            NEXT;
         }
-        case OP_ENTER_CLASS: {
+        CASE(OP_ENTER_CLASS): {
             shark_value parent = POP;
             if (!SHARK_IS_NULL(parent))
                 if (!SHARK_IS_OBJECT(parent)
@@ -1177,24 +3607,22 @@ end:
                 else if (!SHARK_AS_CLASS(parent)->is_object_class)
                     shark_fatal_error(self, "can't extend a native class.");
             current_class = shark_class_new(SHARK_AS_STR(CONST), SHARK_IS_OBJECT(parent) ? SHARK_AS_CLASS(parent) : NULL);
-            DEC_REF(parent);
-            break;
+            NEXT;
         }
-        case OP_EXIT_CLASS:
-            shark_table_set_index(frame.globals, SHARK_FROM_PTR(current_class->name), SHARK_FROM_PTR(current_class));
+        CASE(OP_EXIT_CLASS):
+            shark_table_set_index(frame->globals, SHARK_FROM_PTR(current_class->name), SHARK_FROM_PTR(current_class));
             shark_object_dec_ref(current_class);
             current_class = NULL;
-            break;
-        case OP_DEFINE: {
+            NEXT;
+        CASE(OP_DEFINE): {
             shark_value value = POP;
-            shark_table_set_index(frame.globals, CONST, value);
-            shark_value_dec_ref(value);
-            break;
+            shark_table_set_index(frame->globals, CONST, value);
+            NEXT;
         }
-        case OP_DEFINE_FIELD:
-            CONST;
-            break;
-        case OP_FUNCTION: {
+        CASE(OP_DEFINE_FIELD):
+            frame->code += 2;
+            NEXT;
+        CASE(OP_FUNCTION): {
             shark_function *function = shark_object_new(&shark_function_class);
             function->arity = (size_t) FETCH;
             function->name = shark_object_inc_ref(SHARK_AS_STR(CONST));
@@ -1205,154 +3633,186 @@ end:
                     shark_table_get_index(current_class->methods, SHARK_FROM_PTR(function->name))));
                 shark_table_set_index(current_class->methods,
                     SHARK_FROM_PTR(function->name), SHARK_FROM_PTR(function));
+                self->method_epoch++;
             } else {
                 function->is_method = false;
                 function->owner_class = NULL;
                 function->supermethod = NULL;
-                shark_table_set_index(frame.module->names,
+                shark_table_set_index(frame->module->names,
                     SHARK_FROM_PTR(function->name), SHARK_FROM_PTR(function));
             }
-            function->owner = shark_object_inc_ref(frame.module);
+            function->owner = shark_object_inc_ref(frame->module);
             function->type = SHARK_BYTECODE_FUNCTION;
             size_t code_size = (size_t) FETCH_INT;
-            function->code.bytecode = frame.code;
-            frame.code += code_size;
+            function->code.bytecode = frame->code;
+            function->code_size = code_size;
+            frame->code += code_size;
             shark_object_dec_ref(function);
-            break;
+            NEXT;
         }
-        case OP_NOT_IMPLEMENTED:
+        CASE(OP_NOT_IMPLEMENTED):
             shark_fatal_error(self, "function is not implemented.");
-            break;
-        case OP_EXIT: {
-            size_t block_size = (size_t) FETCH;
-            for (size_t i = 0; i < block_size; i++)
-                shark_value_dec_ref(POP);
-            break;
+            NEXT;
+        CASE(OP_EXIT):
+            self->TOS -= (size_t) FETCH;
+            NEXT;
+        CASE(OP_DUP): {
+            shark_value value = self->stack[self->TOS-1];
+            PUSH(value);
+            NEXT;
         }
-        case OP_DUP:
-            PUSH(self->stack[self->TOS-1]);
-            break;
-        case OP_DROP:
-            shark_value_dec_ref(POP);
-            break;
-        case OP_SWAP: {
+        CASE(OP_DROP):
+            self->TOS--;
+            NEXT;
+        CASE(OP_SWAP): {
             shark_value top = self->stack[self->TOS-1];
             self->stack[self->TOS-1] = self->stack[self->TOS-2];
             self->stack[self->TOS-2] = top;
-            break;
+            NEXT;
         }
-#define NUM_BINOP(CODE, OP)     case CODE: { \
+/* The arithmetic and comparison ops only accept numbers, so once one of them
+** gets through the type check it rewrites itself into its _NUM form, which
+** works on the stack in place. A _NUM op
+** that finds anything else turns back into the generic op and retries it,
+** which then reports the error. */
+#define NUM_BINOP_QUICK(CODE, QUICK, FROM, OP)   CASE(QUICK): { \
+    shark_value y = self->stack[self->TOS-1]; \
+    shark_value x = self->stack[self->TOS-2]; \
+    if (!SHARK_IS_NUM(x) || !SHARK_IS_NUM(y)) { \
+        *(--frame->code) = CODE; \
+        NEXT; \
+    } \
+    self->stack[self->TOS-2] = FROM(SHARK_AS_NUM(x) OP SHARK_AS_NUM(y)); \
+    self->TOS--; \
+    NEXT; \
+}
+#define NUM_BINOP(CODE, QUICK, OP)  CASE(CODE): { \
     shark_value y = POP; \
     shark_value x = POP; \
     if (!SHARK_IS_NUM(x) || !SHARK_IS_NUM(y)) \
         shark_fatal_error(self, "unsupported operand types for " #OP " operator."); \
+    frame->code[-1] = QUICK; \
     PUSH(SHARK_FROM_NUM(SHARK_AS_NUM(x) OP SHARK_AS_NUM(y))); \
-    break; \
-}
-        NUM_BINOP(OP_MUL, *)
-        NUM_BINOP(OP_DIV, /)
-        case OP_MOD: {
+    NEXT; \
+} \
+NUM_BINOP_QUICK(CODE, QUICK, SHARK_FROM_NUM, OP)
+        NUM_BINOP(OP_MUL, OP_MUL_NUM, *)
+        NUM_BINOP(OP_DIV, OP_DIV_NUM, /)
+        CASE(OP_MOD): {
             shark_value y = POP;
             shark_value x = POP;
             if (!SHARK_IS_INT(x) || !SHARK_IS_INT(y))
                 shark_fatal_error(self, "unsupported operand types for % operator. (expected two integers)");
             PUSH(SHARK_FROM_INT(SHARK_AS_INT(x) % SHARK_AS_INT(y)));
-            break;
+            NEXT;
         }
-        NUM_BINOP(OP_ADD, +)
-        NUM_BINOP(OP_SUB, -)
+        NUM_BINOP(OP_ADD, OP_ADD_NUM, +)
+        NUM_BINOP(OP_SUB, OP_SUB_NUM, -)
 #undef NUM_BINOP
-#define COMP_BINOP(CODE, OP)    case CODE: { \
+#define COMP_BINOP(CODE, QUICK, OP) CASE(CODE): { \
     shark_value y = POP; \
     shark_value x = POP; \
     if (!SHARK_IS_NUM(x) || !SHARK_IS_NUM(y)) \
         shark_fatal_error(self, "unsupported operand types for " #OP " operator."); \
+    frame->code[-1] = QUICK; \
     PUSH(SHARK_FROM_BOOL(SHARK_AS_NUM(x) OP SHARK_AS_NUM(y))); \
-    break; \
-}
-        COMP_BINOP(OP_LT, <)
-        COMP_BINOP(OP_LE, <=)
-        COMP_BINOP(OP_GT, >)
-        COMP_BINOP(OP_GE, >=)
+    NEXT; \
+} \
+NUM_BINOP_QUICK(CODE, QUICK, SHARK_FROM_BOOL, OP)
+        COMP_BINOP(OP_LT, OP_LT_NUM, <)
+        COMP_BINOP(OP_LE, OP_LE_NUM, <=)
+        COMP_BINOP(OP_GT, OP_GT_NUM, >)
+        COMP_BINOP(OP_GE, OP_GE_NUM, >=)
 #undef COMP_BINOP
-        case OP_EQ: {
+#undef NUM_BINOP_QUICK
+        CASE(OP_EQ): {
             shark_value y = POP;
             shark_value x = POP;
             PUSH(SHARK_FROM_BOOL(shark_value_equals(x, y)));
-            shark_value_dec_ref(y);
-            shark_value_dec_ref(x);
-            break;
+            NEXT;
         }
-        case OP_NE: {
+        CASE(OP_NE): {
             shark_value y = POP;
             shark_value x = POP;
             PUSH(SHARK_FROM_BOOL(!shark_value_equals(x, y)));
-            shark_value_dec_ref(y);
-            shark_value_dec_ref(x);
-            break;
+            NEXT;
         }
-        case OP_IN: {
+        CASE(OP_IN): {
             shark_value y = POP;
             shark_value x = POP;
             if (!SHARK_IS_OBJECT(y)
             || SHARK_AS_OBJECT(y)->type != &shark_table_class)
                 shark_fatal_error(self, "can't test membership in a non-table value.");
             PUSH(SHARK_FROM_BOOL(shark_table_contains(SHARK_AS_TABLE(y), x)));
-            shark_value_dec_ref(x);
-            DEC_REF(y);
-            break;
+            NEXT;
         }
-        case OP_NOT_IN: {
+        CASE(OP_NOT_IN): {
             shark_value y = POP;
             shark_value x = POP;
             if (!SHARK_IS_OBJECT(y)
             || SHARK_AS_OBJECT(y)->type != &shark_table_class)
                 shark_fatal_error(self, "can't test membership in a non-table value.");
             PUSH(SHARK_FROM_BOOL(!shark_table_contains(SHARK_AS_TABLE(y), x)));
-            shark_value_dec_ref(x);
-            DEC_REF(y);
-            break;
+            NEXT;
         }
-        case OP_NEG: {
+        CASE(OP_NEG): {
             shark_value x = POP;
             if (!SHARK_IS_NUM(x))
                 shark_fatal_error(self, "unsupported operand for - unary op.");
             PUSH(SHARK_FROM_NUM(-SHARK_AS_NUM(x)));
-            break;
+            NEXT;
         }
-        case OP_NOT: {
+        CASE(OP_NOT): {
             shark_value x = POP;
             if (!SHARK_IS_BOOL(x))
                 shark_fatal_error(self, "expected a bool value in 'not' negation.");
             PUSH(SHARK_FROM_BOOL(!SHARK_AS_BOOL(x)));
-            break;
+            NEXT;
         }
 
-#define FUNCTION_CALL(callee, argc, self_offset) \
+/* Calls to bytecode functions don't recurse, they push a frame and carry on
+** in the callee, the result is handled at call_return when it's done. */
+#ifdef SHARK_JIT
+#define JIT_CALL    if (shark_jit_enter(self, frame, frame->code, &result)) goto call_return;
+#else
+#define JIT_CALL
+#endif
+#define FUNCTION_CALL(callee, argc, self_offset, kind) \
     if (argc != callee->arity) { \
         fprintf(stderr, "while calling function '%s': ", callee->name->data); \
         shark_fatal_error(self, "arity mismatch in function call."); \
     } \
     shark_module *module = callee->owner; \
-    shark_value result; \
     if (callee->type == SHARK_BYTECODE_FUNCTION) { \
-        result = shark_vm_execute(self, &frame, module, callee); \
-        if (!self_offset) DEC_REF(POP); \
-    } else { \
-        shark_vm_frame child = { &frame, module, callee, \
-            NULL, NULL, 0, NULL }; \
-        self->bottom = &child; \
-        result = callee->code.native_code(self, self->stack + self->TOS - argc - self_offset, self->error); \
-        for (size_t i = 0; i < argc; i++) \
-            shark_value_dec_ref(POP); \
-        DEC_REF(POP); \
+        shark_vm_frame *callee_frame = shark_vm_push_frame(self); \
+        callee_frame->parent = frame; \
+        callee_frame->module = module; \
+        callee_frame->function = callee; \
+        callee_frame->globals = module->names; \
+        callee_frame->const_table = module->const_table; \
+        callee_frame->base = self->TOS - argc - self_offset; \
+        callee_frame->code = callee->code.bytecode; \
+        callee_frame->call = kind; \
+        frame = callee_frame; \
+        SHARK_VM_CHECK_STACK(self, callee->code_size); \
+        self->bottom = frame; \
+        SHARK_VM_SAFEPOINT(self); \
+        JIT_CALL \
+        NEXT; \
     } \
-    PUSH(result); \
+    shark_vm_frame child = { frame, module, callee, \
+        NULL, NULL, 0, NULL }; \
+    self->bottom = &child; \
+    result = callee->code.native_code(self, self->stack + self->TOS - argc - self_offset, self->error); \
+    self->TOS -= argc + 1; \
+    if (kind != SHARK_CALL_NEW) \
+        PUSH(result); \
     shark_value_dec_ref(result); \
-    self->bottom = &frame; \
-    if (self->error->message != NULL) goto end;
+    self->bottom = frame; \
+    if (self->error->message != NULL) goto end; \
+    SHARK_VM_SAFEPOINT(self);
 
-        case OP_FUNCTION_CALL: {
+        CASE(OP_FUNCTION_CALL): {
             size_t argc = (size_t) FETCH;
             shark_value callee = self->stack[self->TOS - argc - 1];
             if (!SHARK_IS_OBJECT(callee)
@@ -1360,11 +3820,15 @@ end:
                 shark_fatal_error(self, "can't call a non-function value.");
             }
             // printf("function call %s\n", SHARK_AS_FUNCTION(callee)->name->data);
-            FUNCTION_CALL(SHARK_AS_FUNCTION(callee), argc, 0);
-            break;
+            FUNCTION_CALL(SHARK_AS_FUNCTION(callee), argc, 0, SHARK_CALL_FUNCTION);
+            NEXT;
         }
-        case OP_METHOD_CALL: {
+        CASE(OP_METHOD_CALL): {
             // shark_print_stack_trace();
+            if (shark_vm_quicken_method(frame->module, frame->code - 1, frame->code + 1, OP_METHOD_CALL_IC)) {
+                frame->code--;
+                NEXT;
+            }
             size_t argc = (size_t) FETCH;
             shark_value object = self->stack[self->TOS - argc - 1];
             if (!SHARK_IS_OBJECT(object) || SHARK_AS_OBJECT(object)->type->methods == NULL)
@@ -1374,10 +3838,10 @@ end:
             if (callee == NULL)
                 shark_fatal_error(self, "object has no method with that name.");
             // printf("method call %s\n", callee->name->data);
-            FUNCTION_CALL(callee, argc, 1);
-            break;
+            FUNCTION_CALL(callee, argc, 1, SHARK_CALL_METHOD);
+            NEXT;
         }
-        case OP_GET_INDEX: {
+        CASE(OP_GET_INDEX): {
             shark_value index = POP;
             shark_value source = POP;
             if (!SHARK_IS_OBJECT(source))
@@ -1394,25 +3858,40 @@ end:
             } else {
                 shark_fatal_error(self, "unsupported operand for indexing (expected array or table).");
             }
-            shark_value_dec_ref(index);
-            DEC_REF(source);
-            break;
+            NEXT;
         }
-        case OP_SELF:
-            PUSH(self->stack[frame.base]);
-            break;
-        case OP_SUPER_CALL: {
+        CASE(OP_SELF):
+            PUSH(self->stack[frame->base]);
+            NEXT;
+        CASE(OP_METHOD_CALL_IC): {
             size_t argc = (size_t) FETCH;
-            shark_string *name = frame.function->name;
+            shark_method_cache *cache = &frame->module->method_cache[FETCH_SHORT];
             shark_value object = self->stack[self->TOS - argc - 1];
-            shark_function *callee = SHARK_AS_FUNCTION(shark_table_get_index(
-                SHARK_AS_OBJECT(object)->type->methods, SHARK_FROM_PTR(name)))->supermethod;
+            if (!SHARK_IS_OBJECT(object) || SHARK_AS_OBJECT(object)->type->methods == NULL)
+                shark_fatal_error(self, "invalid method call reciever. (expected an object)");
+            shark_class *type = SHARK_AS_OBJECT(object)->type;
+            shark_function *callee = shark_method_cache_lookup(self, cache, type);
+            if (callee == NULL) {
+                callee = SHARK_AS_FUNCTION(shark_table_get_index(type->methods, cache->name));
+                if (callee == NULL)
+                    shark_fatal_error(self, "object has no method with that name.");
+                shark_method_cache_fill(self, cache, type, callee);
+            }
+            FUNCTION_CALL(callee, argc, 1, SHARK_CALL_METHOD);
+            NEXT;
+        }
+        CASE(OP_SUPER_CALL): {
+            /* The supermethod is fixed when the calling method is defined,
+            ** so there's nothing to look up (going through the class of the
+            ** receiver would call the same method again in a subclass). */
+            size_t argc = (size_t) FETCH;
+            shark_function *callee = frame->function->supermethod;
             if (callee == NULL)
                 shark_fatal_error(self, "method has no supermethod.");
-            FUNCTION_CALL(callee, argc, 1);
-            break;
+            FUNCTION_CALL(callee, argc, 1, SHARK_CALL_METHOD);
+            NEXT;
         }
-        case OP_SIZEOF: {
+        CASE(OP_SIZEOF): {
             shark_value x = POP;
             if (!SHARK_IS_OBJECT(x))
                 shark_fatal_error(self, "can't get the sizeof of a scalar type.");
@@ -1425,10 +3904,9 @@ end:
             } else {
                 shark_fatal_error(self, "invalid operand type for sizeof operator.");
             }
-            DEC_REF(x);
-            break;
+            NEXT;
         }
-        case OP_NEW: {
+        CASE(OP_NEW): {
             size_t argc = (size_t) FETCH;
             shark_value type = self->stack[self->TOS - argc - 1];
             if (!SHARK_IS_OBJECT(type)
@@ -1436,25 +3914,33 @@ end:
                 shark_fatal_error(self, "invalid operand for new operator (expected a class).");
             shark_value object;
             if (SHARK_AS_CLASS(type)->is_object_class) {
-                object = SHARK_FROM_PTR(shark_object_inc_ref(shark_table_new()));
-                SHARK_AS_OBJECT(object)->type = SHARK_AS_CLASS(type);
+                shark_class *object_class = SHARK_AS_CLASS(type);
+                if (object_class->shape == NULL)
+                    object_class->shape = shark_shape_new();
+                object = SHARK_FROM_PTR(shark_table_new_shaped(object_class->shape));
+                SHARK_AS_OBJECT(object)->type = object_class;
             } else {
-                object = SHARK_FROM_PTR(shark_object_inc_ref(shark_object_new(SHARK_AS_CLASS(type))));
+                object = SHARK_FROM_PTR(shark_object_new(SHARK_AS_CLASS(type)));
             }
+            /* the object takes the place of the class and is also passed to
+            ** init in a new slot under the arguments, so it's left as the
+            ** value of the expression once init returns. */
+            PUSH(SHARK_NULL);
+            memmove(self->stack + self->TOS - argc, self->stack + self->TOS - argc - 1,
+                argc * sizeof(shark_value));
+            self->stack[self->TOS - argc - 2] = object;
             self->stack[self->TOS - argc - 1] = object;
-            DEC_REF(type);
+            DEC_REF(object);
             shark_function *callee = SHARK_AS_FUNCTION(shark_table_get_str(
                 SHARK_AS_OBJECT(object)->type->methods, "init"));
             if (callee == NULL)
                 shark_fatal_error(self, "can't create instance of this class (no constructor defined).");
-            FUNCTION_CALL(callee, argc, 1);
-            shark_value_dec_ref(POP);
-            PUSH(object);
-            DEC_REF(object);
-            break;
+            FUNCTION_CALL(callee, argc, 1, SHARK_CALL_NEW);
+            NEXT;
         }
 #undef FUNCTION_CALL
-        case OP_INSTANCEOF: {
+#undef JIT_CALL
+        CASE(OP_INSTANCEOF): {
             shark_value type = POP;
             shark_value value = POP;
             if (!SHARK_IS_OBJECT(type)
@@ -1464,43 +3950,34 @@ end:
                 shark_fatal_error(self, "invalid value operand in instanceof operator (expected an object).");
             PUSH(SHARK_FROM_BOOL(shark_object_instanceof(
                 SHARK_AS_OBJECT(value), SHARK_AS_CLASS(type))));
-            DEC_REF(type);
-            DEC_REF(value);
-            break;
+            NEXT;
         }
-        case OP_ARRAY_NEW:
+        CASE(OP_ARRAY_NEW):
             PUSH(SHARK_FROM_PTR(current_array));
             current_array = shark_array_new();
-            break;
-        case OP_ARRAY_NEW_APPEND: {
-            shark_value x = POP;
-            shark_array_put(current_array, x);
-            shark_value_dec_ref(x);
-            break;
-        }
-        case OP_TABLE_NEW:
+            NEXT;
+        CASE(OP_ARRAY_NEW_APPEND):
+            shark_array_put(current_array, POP);
+            NEXT;
+        CASE(OP_TABLE_NEW):
             PUSH(SHARK_FROM_PTR(current_table));
             current_table = shark_table_new();
-            break;
-        case OP_TABLE_NEW_INSERT: {
+            NEXT;
+        CASE(OP_TABLE_NEW_INSERT): {
             shark_value value = POP;
             shark_value key = POP;
             shark_table_set_index(current_table, key, value);
-            shark_value_dec_ref(key);
-            shark_value_dec_ref(value);
-            break;
+            NEXT;
         }
-        case OP_CONST:
+        CASE(OP_CONST):
             PUSH(CONST);
-            break;
-        case OP_RETURN: {
-            shark_value result = POP;
-			for (size_t i = self->TOS; i > frame.base; i--) {
-                shark_value_dec_ref(POP);
-            }
-            return result;
+            NEXT;
+        CASE(OP_RETURN): {
+            result = POP;
+            self->TOS = frame->base;
+            goto call_return;
         }
-        case OP_INSERT: {
+        CASE(OP_INSERT): {
             shark_value value = POP;
             shark_value index = POP;
             shark_value target = POP;
@@ -1513,57 +3990,55 @@ end:
             shark_array *array_target = SHARK_AS_ARRAY(target);
             if (int_index < 0 || int_index > array_target->length)
                 shark_fatal_error(self, "insert index out of range.");
-            for (size_t i = array_target->length; i > int_index; i--)
-                array_target->data[i] = array_target->data[i - 1];
-            array_target->data[int_index] = value;
-            array_target->length++;
-            shark_array_grow(array_target);
-            shark_object_dec_ref(array_target);
-            break;
+            shark_array_insert(array_target, int_index, value);
+            NEXT;
         }
-        case OP_APPEND: {
+        CASE(OP_APPEND): {
             shark_value value = POP;
             shark_value target = POP;
             if (!SHARK_IS_OBJECT(target)
             || SHARK_AS_OBJECT(target)->type != &shark_array_class)
                 shark_fatal_error(self, "invalid append target (expected an array).");
             shark_array_put(SHARK_AS_ARRAY(target), value);
-            shark_value_dec_ref(value);
-            DEC_REF(target);
-            break;
+            NEXT;
         }
-        case OP_STORE_GLOBAL: {
+        CASE(OP_STORE_GLOBAL): {
             shark_value value = POP;
-            shark_table_set_index(frame.globals, CONST, value);
-            shark_value_dec_ref(value);
-            break;
+            shark_table_set_index(frame->globals, CONST, value);
+            NEXT;
         }
-        case OP_STORE:
-            self->stack[frame.base + FETCH] = POP;
-            break;
-        case OP_SET_STATIC: {
+        CASE(OP_STORE):
+            self->stack[frame->base + FETCH] = POP;
+            NEXT;
+        CASE(OP_SET_STATIC): {
             shark_value value = POP;
             shark_value object = POP;
             if (!SHARK_IS_OBJECT(object)
             || SHARK_AS_OBJECT(object)->type != &shark_module_class)
                 shark_fatal_error(self, "can't set static field of non-module object.");
             shark_table_set_index(SHARK_AS_MODULE(object)->names, CONST, value);
-            shark_value_dec_ref(value);
-            DEC_REF(object);
-            break;
+            NEXT;
         }
-        case OP_SET_FIELD: {
+        CASE(OP_SET_FIELD): {
+            QUICKEN_FIELD(OP_SET_FIELD_IC, 0);
             shark_value value = POP;
             shark_value object = POP;
             if (!SHARK_IS_OBJECT(object)
             || !SHARK_AS_OBJECT(object)->type->is_object_class)
                 shark_fatal_error(self, "can't set field of non object.");
             shark_table_set_index(SHARK_AS_TABLE(object), CONST, value);
-            shark_value_dec_ref(value);
-            DEC_REF(object);
-            break;
+            NEXT;
+        }
+        CASE(OP_SET_FIELD_IC): {
+            shark_value value = POP;
+            shark_value object = POP;
+            if (!SHARK_IS_OBJECT(object)
+            || !SHARK_AS_OBJECT(object)->type->is_object_class)
+                shark_fatal_error(self, "can't set field of non object.");
+            shark_table_set_cached(SHARK_AS_TABLE(object), FIELD_CACHE, value);
+            NEXT;
         }
-        case OP_SET_INDEX: {
+        CASE(OP_SET_INDEX): {
             shark_value value = POP;
             shark_value index = POP;
             shark_value source = POP;
@@ -1577,24 +4052,30 @@ end:
                 shark_int_t index_int = SHARK_AS_INT(index);
                 if (index_int < 0 || index_int >= SHARK_AS_ARRAY(source)->length)
                     shark_fatal_error(self, "array index out of range.");
-                SHARK_AS_ARRAY(source)->data[index_int] = shark_value_inc_ref(value);
+                shark_array_set(SHARK_AS_ARRAY(source), (size_t) index_int, value);
             } else {
                 shark_fatal_error(self, "unsupported target for index assignment (expected array or table).");
             }
-            shark_value_dec_ref(value);
-            shark_value_dec_ref(index);
-            DEC_REF(source);
-            break;
+            NEXT;
         }
-        case OP_GET_FIELD_TOP: {
+        CASE(OP_GET_FIELD_TOP): {
+            QUICKEN_FIELD(OP_GET_FIELD_TOP_IC, 0);
             shark_value object = self->stack[self->TOS-1];
             if (!SHARK_IS_OBJECT(object)
             || !SHARK_AS_OBJECT(object)->type->is_object_class)
                 shark_fatal_error(self, "can't get field of a non-object.");
             PUSH(shark_table_get_index(SHARK_AS_TABLE(object), CONST));
-            break;
+            NEXT;
+        }
+        CASE(OP_GET_FIELD_TOP_IC): {
+            shark_value object = self->stack[self->TOS-1];
+            if (!SHARK_IS_OBJECT(object)
+            || !SHARK_AS_OBJECT(object)->type->is_object_class)
+                shark_fatal_error(self, "can't get field of a non-object.");
+            PUSH(shark_table_get_cached(SHARK_AS_TABLE(object), FIELD_CACHE));
+            NEXT;
         }
-        case OP_GET_INDEX_TOP: {
+        CASE(OP_GET_INDEX_TOP): {
             shark_value index = self->stack[self->TOS-1];
             shark_value source = self->stack[self->TOS-2];
             if (!SHARK_IS_OBJECT(source))
@@ -1611,75 +4092,78 @@ end:
             } else {
                 shark_fatal_error(self, "unsupported target for indexing (expected array or table).");
             }
-            break;
+            NEXT;
         }
-        case OP_GET_STATIC: {
+        CASE(OP_GET_STATIC): {
             shark_value object = POP;
             if (!SHARK_IS_OBJECT(object)
             || SHARK_AS_OBJECT(object)->type != &shark_module_class)
                 shark_fatal_error(self, "can't get static field of a non-module object.");
             PUSH(shark_table_get_index(SHARK_AS_MODULE(object)->names, CONST));
-            DEC_REF(object);
-            break;
+            NEXT;
         }
-        case OP_GET_STATIC_TOP: {
+        CASE(OP_GET_STATIC_TOP): {
             shark_value object = self->stack[self->TOS-1];
             if (!SHARK_IS_OBJECT(object)
             || SHARK_AS_OBJECT(object)->type != &shark_module_class)
                 shark_fatal_error(self, "can't get static field of a non-module object.");
             PUSH(shark_table_get_index(SHARK_AS_MODULE(object)->names, CONST));
-            break;
+            NEXT;
         }
-#define GET_OFFSET      (((uint16_t) frame.code[0]) + (((uint16_t) frame.code[1]) << 8))
-        case OP_IF: {
+#define GET_OFFSET      (((uint16_t) frame->code[0]) + (((uint16_t) frame->code[1]) << 8))
+        CASE(OP_IF): {
             shark_value value = POP;
             if (SHARK_IS_BOOL(value) && SHARK_AS_BOOL(value) == 1) {
-                FETCH_SHORT;
+                frame->code += 2;
             } else {
-                frame.code += GET_OFFSET;
+                frame->code += GET_OFFSET;
             }
-            break;
+            NEXT;
         }
-        case OP_JUMP:
-            frame.code += GET_OFFSET;
-            break;
-        case OP_LOOP:
-            frame.code -= GET_OFFSET;
-            break;
-        case OP_ZERO:
+        CASE(OP_JUMP):
+            frame->code += GET_OFFSET;
+            NEXT;
+        CASE(OP_LOOP):
+            frame->code -= GET_OFFSET;
+            SHARK_VM_SAFEPOINT(self);
+#ifdef SHARK_JIT
+            if (frame->function != NULL && shark_jit_enter(self, frame, frame->code, &result))
+                goto call_return;
+#endif
+            NEXT;
+        CASE(OP_ZERO):
             PUSH(SHARK_FROM_NUM(0));
-            break;
-        case OP_INC: {
+            NEXT;
+        CASE(OP_INC): {
             uint16_t local = FETCH;
-            shark_value value = self->stack[frame.base + local];
+            shark_value value = self->stack[frame->base + local];
             if (!SHARK_IS_NUM(value))
                 shark_fatal_error(self, "can't increment a non numeric value.");
-            self->stack[frame.base + local] = SHARK_FROM_NUM(SHARK_AS_NUM(value) + 1);
-            break;
+            self->stack[frame->base + local] = SHARK_FROM_NUM(SHARK_AS_NUM(value) + 1);
+            NEXT;
         }
-        case OP_OR: {
+        CASE(OP_OR): {
             shark_value value = self->stack[self->TOS-1];
             if (SHARK_IS_NULL(value)
             || (SHARK_IS_BOOL(value) && SHARK_AS_BOOL(value) == 0)) {
                 POP;
-                FETCH_SHORT;
+                frame->code += 2;
             } else {
-                frame.code += GET_OFFSET;
+                frame->code += GET_OFFSET;
             }
-            break;
+            NEXT;
         }
-        case OP_AND: {
+        CASE(OP_AND): {
             shark_value value = self->stack[self->TOS-1];
             if ((SHARK_IS_BOOL(value) && SHARK_AS_BOOL(value) == 1)
             || (!SHARK_IS_NULL(value) && !SHARK_IS_BOOL(value))) {
-                shark_value_dec_ref(POP);
-                FETCH_SHORT;
+                self->TOS--;
+                frame->code += 2;
             } else {
-                frame.code += GET_OFFSET;
+                frame->code += GET_OFFSET;
             }
-            break;
+            NEXT;
         }
-#undef GET_OFFSET
 #define AU_BINOP(X, Y, OP, RESULT)  { \
     if (!SHARK_IS_NUM(X) || !SHARK_IS_NUM(Y)) \
         shark_fatal_error(self, "unsupported operand types for numeric operator."); \
@@ -1693,7 +4177,7 @@ end:
         default: RESULT = SHARK_NULL; break; \
     } \
 }
-        case OP_SET_INDEX_AU: {
+        CASE(OP_SET_INDEX_AU): {
             shark_value z = POP;
             shark_value y = POP;
             shark_value x = POP;
@@ -1704,7 +4188,6 @@ end:
             if (SHARK_AS_OBJECT(x)->type == &shark_table_class) {
                 AU_BINOP(shark_table_get_index(SHARK_AS_TABLE(x), y), z, op, result);
                 shark_table_set_index(SHARK_AS_TABLE(x), y, result);
-                shark_value_dec_ref(y);
             } else if (SHARK_AS_OBJECT(x)->type == &shark_array_class) {
                 if (!SHARK_IS_INT(y))
                     shark_fatal_error(self, "expected an integer as array index.");
@@ -1712,14 +4195,14 @@ end:
                 if (index_int < 0 || index_int >= SHARK_AS_ARRAY(x)->length)
                     shark_fatal_error(self, "array index out of range.");
                 AU_BINOP(SHARK_AS_ARRAY(x)->data[index_int], z, op, result);
-                SHARK_AS_ARRAY(x)->data[index_int] = result;
+                shark_array_set(SHARK_AS_ARRAY(x), (size_t) index_int, result);
             } else {
                 shark_fatal_error(self, "unsupported target for index assignment (expected array or table).");
             }
-            DEC_REF(x);
-            break;
+            NEXT;
         }
-        case OP_SET_FIELD_AU: {
+        CASE(OP_SET_FIELD_AU): {
+            QUICKEN_FIELD(OP_SET_FIELD_AU_IC, 1);
             shark_value y = POP;
             shark_value x = POP;
             if (!SHARK_IS_OBJECT(x)
@@ -1730,10 +4213,22 @@ end:
             shark_value result;
             AU_BINOP(shark_table_get_index(SHARK_AS_TABLE(x), field), y, op, result);
             shark_table_set_index(SHARK_AS_TABLE(x), field, result);
-            DEC_REF(x);
-            break;
+            NEXT;
+        }
+        CASE(OP_SET_FIELD_AU_IC): {
+            shark_value y = POP;
+            shark_value x = POP;
+            if (!SHARK_IS_OBJECT(x)
+            || !SHARK_AS_OBJECT(x)->type->is_object_class)
+                shark_fatal_error(self, "can't set field of non object.");
+            uint8_t op = FETCH;
+            shark_field_cache *cache = FIELD_CACHE;
+            shark_value result;
+            AU_BINOP(shark_table_get_cached(SHARK_AS_TABLE(x), cache), y, op, result);
+            shark_table_set_cached(SHARK_AS_TABLE(x), cache, result);
+            NEXT;
         }
-        case OP_SET_STATIC_AU: {
+        CASE(OP_SET_STATIC_AU): {
             shark_value y = POP;
             shark_value x = POP;
             if (!SHARK_IS_OBJECT(x)
@@ -1744,33 +4239,188 @@ end:
             shark_value result;
             AU_BINOP(shark_table_get_index(SHARK_AS_MODULE(x)->names, field), y, op, result);
             shark_table_set_index(SHARK_AS_MODULE(x)->names, field, result);
-            DEC_REF(x);
-            break;
+            NEXT;
+        }
+        CASE(OP_LOAD_LOAD): {
+            uint8_t x = FETCH;
+            uint8_t y = FETCH;
+            PUSH(self->stack[frame->base + x]);
+            PUSH(self->stack[frame->base + y]);
+            NEXT;
+        }
+        CASE(OP_LOAD_CONST):
+            PUSH(self->stack[frame->base + FETCH]);
+            PUSH(CONST);
+            NEXT;
+        CASE(OP_SELF_GET_FIELD): {
+            QUICKEN_FIELD(OP_SELF_GET_FIELD_IC, 0);
+            shark_value object = self->stack[frame->base];
+            if (!SHARK_IS_OBJECT(object)
+            || !SHARK_AS_OBJECT(object)->type->is_object_class)
+                shark_fatal_error(self, "can't get field of a non-object.");
+            PUSH(shark_table_get_index(SHARK_AS_TABLE(object), CONST));
+            NEXT;
+        }
+        CASE(OP_SELF_GET_FIELD_IC): {
+            shark_value object = self->stack[frame->base];
+            if (!SHARK_IS_OBJECT(object)
+            || !SHARK_AS_OBJECT(object)->type->is_object_class)
+                shark_fatal_error(self, "can't get field of a non-object.");
+            PUSH(shark_table_get_cached(SHARK_AS_TABLE(object), FIELD_CACHE));
+            NEXT;
+        }
+        CASE(OP_LOAD_RETURN):
+            result = self->stack[frame->base + FETCH];
+            self->TOS = frame->base;
+            goto call_return;
+        CASE(OP_STORE_AU): {
+            shark_value y = POP;
+            uint8_t op = FETCH;
+            uint8_t local = FETCH;
+            shark_value x = self->stack[frame->base + local];
+            shark_value result;
+            AU_BINOP(x, y, op, result);
+            self->stack[frame->base + local] = result;
+            NEXT;
+        }
+        CASE(OP_EQ_IF): {
+            shark_value y = POP;
+            shark_value x = POP;
+            bool equals = shark_value_equals(x, y);
+            if (equals) frame->code += 2;
+            else frame->code += GET_OFFSET;
+            NEXT;
+        }
+        CASE(OP_NE_IF): {
+            shark_value y = POP;
+            shark_value x = POP;
+            bool equals = shark_value_equals(x, y);
+            if (!equals) frame->code += 2;
+            else frame->code += GET_OFFSET;
+            NEXT;
+        }
+#define COMP_IF(CODE, OP)   CASE(CODE): { \
+    shark_value y = POP; \
+    shark_value x = POP; \
+    if (!SHARK_IS_NUM(x) || !SHARK_IS_NUM(y)) \
+        shark_fatal_error(self, "unsupported operand types for " #OP " operator."); \
+    if (SHARK_AS_NUM(x) OP SHARK_AS_NUM(y)) frame->code += 2; \
+    else frame->code += GET_OFFSET; \
+    NEXT; \
+}
+        COMP_IF(OP_LT_IF, <)
+        COMP_IF(OP_LE_IF, <=)
+        COMP_IF(OP_GT_IF, >)
+        COMP_IF(OP_GE_IF, >=)
+#undef COMP_IF
+        CASE(OP_LOAD_LOAD_LT_IF): {
+            shark_value x = self->stack[frame->base + FETCH];
+            shark_value y = self->stack[frame->base + FETCH];
+            if (!SHARK_IS_NUM(x) || !SHARK_IS_NUM(y))
+                shark_fatal_error(self, "unsupported operand types for < operator.");
+            if (SHARK_AS_NUM(x) < SHARK_AS_NUM(y)) frame->code += 2;
+            else frame->code += GET_OFFSET;
+            NEXT;
+        }
+#define REG(x)  ((x) & SHARK_REG_CONST \
+                ? frame->const_table[(x) & (SHARK_REG_CONST - 1)] \
+                : self->stack[frame->base + (x)])
+#define REG_STORE(dst, value) { \
+    shark_value __REG_VALUE__ = value; \
+    if (dst == SHARK_REG_PUSH) { \
+        PUSH(__REG_VALUE__); \
+    } else { \
+        self->stack[frame->base + dst] = __REG_VALUE__; \
+    } \
+}
+        CASE(OP_MOVE): {
+            uint8_t dst = FETCH;
+            uint16_t src = FETCH_SHORT;
+            self->stack[frame->base + dst] = REG(src);
+            NEXT;
+        }
+#define REG_BINOP(CODE, OP) CASE(CODE): { \
+    uint8_t dst = FETCH; \
+    uint16_t a = FETCH_SHORT; \
+    uint16_t b = FETCH_SHORT; \
+    shark_value x = REG(a); \
+    shark_value y = REG(b); \
+    if (!SHARK_IS_NUM(x) || !SHARK_IS_NUM(y)) \
+        shark_fatal_error(self, "unsupported operand types for " #OP " operator."); \
+    REG_STORE(dst, SHARK_FROM_NUM(SHARK_AS_NUM(x) OP SHARK_AS_NUM(y))); \
+    NEXT; \
+}
+        REG_BINOP(OP_ADD_R, +)
+        REG_BINOP(OP_SUB_R, -)
+        REG_BINOP(OP_MUL_R, *)
+        REG_BINOP(OP_DIV_R, /)
+#undef REG_BINOP
+        CASE(OP_MOD_R): {
+            uint8_t dst = FETCH;
+            uint16_t a = FETCH_SHORT;
+            uint16_t b = FETCH_SHORT;
+            shark_value x = REG(a);
+            shark_value y = REG(b);
+            if (!SHARK_IS_INT(x) || !SHARK_IS_INT(y))
+                shark_fatal_error(self, "unsupported operand types for % operator. (expected two integers)");
+            REG_STORE(dst, SHARK_FROM_INT(SHARK_AS_INT(x) % SHARK_AS_INT(y)));
+            NEXT;
+        }
+        CASE(OP_EQ_R_IF): {
+            uint16_t a = FETCH_SHORT;
+            uint16_t b = FETCH_SHORT;
+            if (shark_value_equals(REG(a), REG(b))) frame->code += 2;
+            else frame->code += GET_OFFSET;
+            NEXT;
         }
+        CASE(OP_NE_R_IF): {
+            uint16_t a = FETCH_SHORT;
+            uint16_t b = FETCH_SHORT;
+            if (!shark_value_equals(REG(a), REG(b))) frame->code += 2;
+            else frame->code += GET_OFFSET;
+            NEXT;
+        }
+#define REG_COMP_IF(CODE, OP)   CASE(CODE): { \
+    uint16_t a = FETCH_SHORT; \
+    uint16_t b = FETCH_SHORT; \
+    shark_value x = REG(a); \
+    shark_value y = REG(b); \
+    if (!SHARK_IS_NUM(x) || !SHARK_IS_NUM(y)) \
+        shark_fatal_error(self, "unsupported operand types for " #OP " operator."); \
+    if (SHARK_AS_NUM(x) OP SHARK_AS_NUM(y)) frame->code += 2; \
+    else frame->code += GET_OFFSET; \
+    NEXT; \
+}
+        REG_COMP_IF(OP_LT_R_IF, <)
+        REG_COMP_IF(OP_LE_R_IF, <=)
+        REG_COMP_IF(OP_GT_R_IF, >)
+        REG_COMP_IF(OP_GE_R_IF, >=)
+#undef REG_COMP_IF
+#undef REG_STORE
+#undef REG
+#undef GET_OFFSET
 #undef AU_BINOP
-        case OP_ARRAY_CLOSE: {
+        CASE(OP_ARRAY_CLOSE): {
             shark_array *current = SHARK_AS_ARRAY(POP);
-            shark_object_dec_ref(current);
             PUSH(SHARK_FROM_PTR(current_array));
             shark_object_dec_ref(current_array);
             current_array = current;
-            break;
+            NEXT;
         }
-        case OP_TABLE_CLOSE: {
+        CASE(OP_TABLE_CLOSE): {
             shark_table *current = SHARK_AS_TABLE(POP);
-            shark_object_dec_ref(current);
             PUSH(SHARK_FROM_PTR(current_table));
             shark_object_dec_ref(current_table);
             current_table = current;
-            break;
+            NEXT;
         }
-#define BINARY_BINOP(CODE, OP, NAME)    case CODE: { \
+#define BINARY_BINOP(CODE, OP, NAME)    CASE(CODE): { \
     shark_value y = POP; \
     shark_value x = POP; \
     if (!SHARK_IS_INT(x) || !SHARK_IS_INT(y)) \
         shark_fatal_error(self, "unsupported operand types for " #NAME " operator."); \
     PUSH(SHARK_FROM_INT(((uint32_t) SHARK_AS_INT(x)) OP ((uint32_t) SHARK_AS_INT(y)))); \
-    break; \
+    NEXT; \
 }
         BINARY_BINOP(OP_BAND, &, &)
         BINARY_BINOP(OP_BOR, |, |)
@@ -1778,17 +4428,17 @@ end:
         BINARY_BINOP(OP_BSHL, <<, left_shift)
         BINARY_BINOP(OP_BSHR, >>, right_shift)
 #undef BINARY_BINOP
-        case OP_BNOT: {
+        CASE(OP_BNOT): {
             shark_value x = POP;
             if (!SHARK_IS_INT(x))
                 shark_fatal_error(self, "unsupported operand for ~ unary op.");
             PUSH(SHARK_FROM_INT(~((uint32_t) SHARK_AS_INT(x))));
-            break;
+            NEXT;
         }
-        default:
-            fprintf(stderr, "usuported operation: %d\n", *(--frame.code));
+        DEFAULT:
+            fprintf(stderr, "usuported operation: %d\n", *(--frame->code));
             shark_fatal_error(self, "");
-            break;
+            NEXT;
         }
     }
 #undef FETCH
@@ -1799,6 +4449,11 @@ end:
 #undef EXIT
 #undef CONST
 #undef DEC_REF
+#undef FIELD_CACHE
+#undef QUICKEN_FIELD
+#undef CASE
+#undef DEFAULT
+#undef NEXT
 }
 
 SHARK_API void shark_vm_exec_module(shark_vm *self, shark_module *module)
@@ -1848,8 +4503,6 @@ SHARK_API shark_value shark_vm_exec_main(shark_vm *self, shark_module *module, s
     shark_function *main = SHARK_AS_FUNCTION(main_value);
     
     self->stack[self->TOS++] = SHARK_FROM_PTR(args);
-    if (self->TOS == self->stack_size)
-        shark_vm_grow_stack(self);
 
     shark_vm_execute(self, NULL, main->owner, main);
 }
@@ -0,0 +1,1179 @@
+/******************************************************************************
+*** Copyright *****************************************************************
+**
+** Copyright 2022 Daniel Alvarez <shogundevel@gmail.com>
+**
+** Permission is hereby granted, free of charge, to any person
+** obtaining a copy of this software and associated documentation files
+** (the "Software"), to deal in the Software without restriction,
+** including without limitation the rights to use, copy, modify, merge,
+** publish, distribute, sublicense, and/or sell copies of the Software,
+** and to permit persons to whom the Software is furnished to do so,
+** subject to the following conditions:
+**
+** The above copyright notice and this permission notice shall be
+** included in all copies or substantial portions of the Software.
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+** EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+** MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+** IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+** CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+** TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+** SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+**
+******************************************************************************/
+
+/* Baseline template JIT for x86-64, included by cshark_core.c.
+**
+** Once a bytecode function is hot (SHARK_JIT_THRESHOLD calls plus loop
+** iterations) its bytecode is translated into machine code one instruction
+** at a time. The operand stack stays in vm->stack, so compiled code and the
+** interpreter can hand a frame over at any instruction: simple instructions
+** get an inline template, calls, field accesses and friends call the helpers
+** below, and anything else exits to the interpreter, which enters the
+** compiled code again at the next loop back edge.
+**
+** Compiled code keeps its state in callee saved registers:
+**      rbx     the vm
+**      r12     the frame
+**      r13     the locals of the frame (vm->stack + frame->base)
+**      r14     the top of the stack (vm->stack + vm->TOS)
+**      rbp     SHARK_OBJECT_MASK
+** vm->TOS is only written back before calling a helper, and r13 and r14 are
+** reloaded afterwards. The room a call needs on the stack is checked when it
+** starts, so pushes don't check for space. [rsp] is a scratch slot that
+** survives calls. */
+
+#include <sys/mman.h>
+
+#ifndef SHARK_JIT_THRESHOLD
+    #define SHARK_JIT_THRESHOLD     1000
+#endif
+#define SHARK_JIT_MAX_COMPILES      4
+#define SHARK_JIT_MAX_DEPTH         256
+#define SHARK_JIT_NO_ENTRY          UINT32_MAX
+
+struct shark_jit_code
+{
+    uint8_t *code;
+    size_t size;
+    uint32_t *map;
+    size_t active;
+    bool retired;
+};
+
+typedef shark_value (*shark_jit_entry)(shark_vm *, shark_vm_frame *, void *);
+
+static bool shark_jit_enabled = false;
+
+/* Compiled code calls script functions through shark_vm_execute on the C
+** stack, so past this many nested entries calls stay in the interpreter. */
+static size_t shark_jit_depth = 0;
+
+static void shark_jit_init()
+{
+    char *option = getenv("SHARK_JIT");
+    shark_jit_enabled = option != NULL && option[0] != '\0' && strcmp(option, "0") != 0;
+}
+
+static void shark_jit_free(shark_jit_code *jit)
+{
+    munmap(jit->code, jit->size);
+    shark_free(jit->map);
+    shark_free(jit);
+}
+
+/* Called when the function that owns 'jit' is destroyed, the code may still
+** be running further up the C stack. */
+static void shark_jit_release(shark_jit_code *jit)
+{
+    if (jit->active == 0)
+        shark_jit_free(jit);
+    else
+        jit->retired = true;
+}
+
+/* Helpers. They find the operand stack in vm->stack (up to vm->TOS) and the
+** operands of their instruction at 'pc'. Helpers for instructions that call
+** other code return true when the frame has to end because a native function
+** set an error, the ones for conditional jumps return the condition. */
+
+typedef bool (*shark_jit_helper)(shark_vm *, shark_vm_frame *, uint8_t *);
+
+#define JIT_POP         (self->stack[--self->TOS])
+#define JIT_SHORT(pc)   (((uint16_t) (pc)[0]) | (((uint16_t) (pc)[1]) << 8))
+#define JIT_REG(x)      ((x) & SHARK_REG_CONST \
+                        ? frame->const_table[(x) & (SHARK_REG_CONST - 1)] \
+                        : self->stack[frame->base + (x)])
+
+static void shark_jit_push(shark_vm *self, shark_value value)
+{
+    self->stack[self->TOS++] = value;
+}
+
+static bool shark_jit_call(shark_vm *self, shark_vm_frame *frame, shark_function *callee, size_t argc, size_t self_offset)
+{
+    if (argc != callee->arity) {
+        fprintf(stderr, "while calling function '%s': ", callee->name->data);
+        shark_fatal_error(self, "arity mismatch in function call.");
+    }
+    shark_module *module = callee->owner;
+    shark_value result;
+    if (callee->type == SHARK_BYTECODE_FUNCTION) {
+        result = shark_vm_execute(self, frame, module, callee);
+        if (!self_offset) self->TOS--;
+    } else {
+        shark_vm_frame child = { frame, module, callee,
+            NULL, NULL, 0, NULL };
+        self->bottom = &child;
+        result = callee->code.native_code(self, self->stack + self->TOS - argc - self_offset, self->error);
+        self->TOS -= argc + 1;
+    }
+    shark_jit_push(self, result);
+    shark_value_dec_ref(result);
+    self->bottom = frame;
+    SHARK_VM_SAFEPOINT(self);
+    return self->error->message != NULL;
+}
+
+static bool shark_jit_function_call(shark_vm *self, shark_vm_frame *frame, uint8_t *pc)
+{
+    size_t argc = (size_t) pc[0];
+    shark_value callee = self->stack[self->TOS - argc - 1];
+    if (!SHARK_IS_OBJECT(callee)
+    || SHARK_AS_OBJECT(callee)->type != &shark_function_class)
+        shark_fatal_error(self, "can't call a non-function value.");
+    return shark_jit_call(self, frame, SHARK_AS_FUNCTION(callee), argc, 0);
+}
+
+static bool shark_jit_method_call(shark_vm *self, shark_vm_frame *frame, uint8_t *pc)
+{
+    size_t argc = (size_t) pc[0];
+    shark_method_cache *cache = &frame->module->method_cache[JIT_SHORT(pc + 1)];
+    shark_value object = self->stack[self->TOS - argc - 1];
+    if (!SHARK_IS_OBJECT(object) || SHARK_AS_OBJECT(object)->type->methods == NULL)
+        shark_fatal_error(self, "invalid method call reciever. (expected an object)");
+    shark_class *type = SHARK_AS_OBJECT(object)->type;
+    shark_function *callee = shark_method_cache_lookup(self, cache, type);
+    if (callee == NULL) {
+        callee = SHARK_AS_FUNCTION(shark_table_get_index(type->methods, cache->name));
+        if (callee == NULL)
+            shark_fatal_error(self, "object has no method with that name.");
+        shark_method_cache_fill(self, cache, type, callee);
+    }
+    return shark_jit_call(self, frame, callee, argc, 1);
+}
+
+static bool shark_jit_super_call(shark_vm *self, shark_vm_frame *frame, uint8_t *pc)
+{
+    shark_function *callee = frame->function->supermethod;
+    if (callee == NULL)
+        shark_fatal_error(self, "method has no supermethod.");
+    return shark_jit_call(self, frame, callee, (size_t) pc[0], 1);
+}
+
+static bool shark_jit_new(shark_vm *self, shark_vm_frame *frame, uint8_t *pc)
+{
+    size_t argc = (size_t) pc[0];
+    shark_value type = self->stack[self->TOS - argc - 1];
+    if (!SHARK_IS_OBJECT(type)
+    || SHARK_AS_OBJECT(type)->type != &shark_class_class)
+        shark_fatal_error(self, "invalid operand for new operator (expected a class).");
+    shark_value object;
+    if (SHARK_AS_CLASS(type)->is_object_class) {
+        shark_class *object_class = SHARK_AS_CLASS(type);
+        if (object_class->shape == NULL)
+            object_class->shape = shark_shape_new();
+        object = SHARK_FROM_PTR(shark_table_new_shaped(object_class->shape));
+        SHARK_AS_OBJECT(object)->type = object_class;
+    } else {
+        object = SHARK_FROM_PTR(shark_object_new(SHARK_AS_CLASS(type)));
+    }
+    self->stack[self->TOS - argc - 1] = object;
+    shark_function *callee = SHARK_AS_FUNCTION(shark_table_get_str(
+        SHARK_AS_OBJECT(object)->type->methods, "init"));
+    if (callee == NULL)
+        shark_fatal_error(self, "can't create instance of this class (no constructor defined).");
+    if (shark_jit_call(self, frame, callee, argc, 1)) {
+        shark_value_dec_ref(object);
+        return true;
+    }
+    self->TOS--;
+    shark_jit_push(self, object);
+    shark_value_dec_ref(object);
+    return false;
+}
+
+static bool shark_jit_load_global(shark_vm *self, shark_vm_frame *frame, uint8_t *pc)
+{
+    shark_jit_push(self, shark_table_get_index(frame->globals, frame->const_table[JIT_SHORT(pc)]));
+    return false;
+}
+
+static bool shark_jit_get_field(shark_vm *self, shark_vm_frame *frame, uint8_t *pc)
+{
+    shark_value object = JIT_POP;
+    if (!SHARK_IS_OBJECT(object)
+    || !SHARK_AS_OBJECT(object)->type->is_object_class)
+        shark_fatal_error(self, "can't get field of a non-object.");
+    shark_jit_push(self, shark_table_get_cached(SHARK_AS_TABLE(object),
+        &frame->module->field_cache[JIT_SHORT(pc)]));
+    return false;
+}
+
+static bool shark_jit_get_field_top(shark_vm *self, shark_vm_frame *frame, uint8_t *pc)
+{
+    shark_value object = self->stack[self->TOS-1];
+    if (!SHARK_IS_OBJECT(object)
+    || !SHARK_AS_OBJECT(object)->type->is_object_class)
+        shark_fatal_error(self, "can't get field of a non-object.");
+    shark_jit_push(self, shark_table_get_cached(SHARK_AS_TABLE(object),
+        &frame->module->field_cache[JIT_SHORT(pc)]));
+    return false;
+}
+
+static bool shark_jit_self_get_field(shark_vm *self, shark_vm_frame *frame, uint8_t *pc)
+{
+    shark_value object = self->stack[frame->base];
+    if (!SHARK_IS_OBJECT(object)
+    || !SHARK_AS_OBJECT(object)->type->is_object_class)
+        shark_fatal_error(self, "can't get field of a non-object.");
+    shark_jit_push(self, shark_table_get_cached(SHARK_AS_TABLE(object),
+        &frame->module->field_cache[JIT_SHORT(pc)]));
+    return false;
+}
+
+static bool shark_jit_set_field(shark_vm *self, shark_vm_frame *frame, uint8_t *pc)
+{
+    shark_value value = JIT_POP;
+    shark_value object = JIT_POP;
+    if (!SHARK_IS_OBJECT(object)
+    || !SHARK_AS_OBJECT(object)->type->is_object_class)
+        shark_fatal_error(self, "can't set field of non object.");
+    shark_table_set_cached(SHARK_AS_TABLE(object), &frame->module->field_cache[JIT_SHORT(pc)], value);
+    return false;
+}
+
+static bool shark_jit_get_index(shark_vm *self, shark_vm_frame *frame, uint8_t *pc)
+{
+    shark_value index = JIT_POP;
+    shark_value source = JIT_POP;
+    if (!SHARK_IS_OBJECT(source))
+        shark_fatal_error(self, "unsupported operand for indexing.");
+    if (SHARK_AS_OBJECT(source)->type == &shark_array_class) {
+        if (!SHARK_IS_INT(index))
+            shark_fatal_error(self, "expected an integer as array index.");
+        else if (SHARK_AS_INT(index) < 0
+        || SHARK_AS_INT(index) >= SHARK_AS_ARRAY(source)->length)
+            shark_fatal_error(self, "array index out of range.");
+        shark_jit_push(self, SHARK_AS_ARRAY(source)->data[SHARK_AS_INT(index)]);
+    } else if (SHARK_AS_OBJECT(source)->type == &shark_table_class) {
+        shark_jit_push(self, shark_table_get_index(SHARK_AS_TABLE(source), index));
+    } else {
+        shark_fatal_error(self, "unsupported operand for indexing (expected array or table).");
+    }
+    return false;
+}
+
+static bool shark_jit_eq(shark_vm *self, shark_vm_frame *frame, uint8_t *pc)
+{
+    shark_value y = JIT_POP;
+    shark_value x = JIT_POP;
+    shark_jit_push(self, SHARK_FROM_BOOL(shark_value_equals(x, y)));
+    return false;
+}
+
+static bool shark_jit_ne(shark_vm *self, shark_vm_frame *frame, uint8_t *pc)
+{
+    shark_value y = JIT_POP;
+    shark_value x = JIT_POP;
+    shark_jit_push(self, SHARK_FROM_BOOL(!shark_value_equals(x, y)));
+    return false;
+}
+
+static bool shark_jit_eq_if(shark_vm *self, shark_vm_frame *frame, uint8_t *pc)
+{
+    shark_value y = JIT_POP;
+    shark_value x = JIT_POP;
+    return shark_value_equals(x, y);
+}
+
+static bool shark_jit_ne_if(shark_vm *self, shark_vm_frame *frame, uint8_t *pc)
+{
+    return !shark_jit_eq_if(self, frame, pc);
+}
+
+static bool shark_jit_eq_r_if(shark_vm *self, shark_vm_frame *frame, uint8_t *pc)
+{
+    return shark_value_equals(JIT_REG(JIT_SHORT(pc)), JIT_REG(JIT_SHORT(pc + 2)));
+}
+
+static bool shark_jit_ne_r_if(shark_vm *self, shark_vm_frame *frame, uint8_t *pc)
+{
+    return !shark_jit_eq_r_if(self, frame, pc);
+}
+
+static bool shark_jit_mod(shark_vm *self, shark_vm_frame *frame, uint8_t *pc)
+{
+    shark_value y = JIT_POP;
+    shark_value x = JIT_POP;
+    if (!SHARK_IS_INT(x) || !SHARK_IS_INT(y))
+        shark_fatal_error(self, "unsupported operand types for % operator. (expected two integers)");
+    shark_jit_push(self, SHARK_FROM_INT(SHARK_AS_INT(x) % SHARK_AS_INT(y)));
+    return false;
+}
+
+static bool shark_jit_mod_r(shark_vm *self, shark_vm_frame *frame, uint8_t *pc)
+{
+    uint8_t dst = pc[0];
+    shark_value x = JIT_REG(JIT_SHORT(pc + 1));
+    shark_value y = JIT_REG(JIT_SHORT(pc + 3));
+    if (!SHARK_IS_INT(x) || !SHARK_IS_INT(y))
+        shark_fatal_error(self, "unsupported operand types for % operator. (expected two integers)");
+    shark_value result = SHARK_FROM_INT(SHARK_AS_INT(x) % SHARK_AS_INT(y));
+    if (dst == SHARK_REG_PUSH) {
+        shark_jit_push(self, result);
+    } else {
+        self->stack[frame->base + dst] = result;
+    }
+    return false;
+}
+
+#undef JIT_POP
+#undef JIT_SHORT
+#undef JIT_REG
+
+/* Code generation. */
+
+enum {
+    JIT_RAX, JIT_RCX, JIT_RDX, JIT_RBX, JIT_RSP, JIT_RBP, JIT_RSI, JIT_RDI,
+    JIT_R8, JIT_R9, JIT_R10, JIT_R11, JIT_R12, JIT_R13, JIT_R14, JIT_R15
+};
+
+#define JIT_VM          JIT_RBX
+#define JIT_FRAME       JIT_R12
+#define JIT_LOCALS      JIT_R13
+#define JIT_TOP         JIT_R14
+#define JIT_MASK        JIT_RBP
+
+/* condition codes */
+enum {
+    JIT_B = 0x2, JIT_AE = 0x3, JIT_E = 0x4, JIT_NE = 0x5,
+    JIT_BE = 0x6, JIT_A = 0x7, JIT_ALWAYS = -1
+};
+
+#define JIT_ONE     ((uint64_t) 0x3FF0000000000000)
+
+enum { JIT_FIXUP_JUMP, JIT_FIXUP_EXIT, JIT_FIXUP_END, JIT_FIXUP_LEAVE };
+
+typedef struct {
+    int kind;
+    size_t pos;
+    size_t target;
+} shark_jit_fixup;
+
+typedef struct {
+    shark_function *function;
+    uint8_t *data;
+    size_t size;
+    size_t capacity;
+    uint32_t *map;
+    shark_jit_fixup *fixups;
+    size_t fixup_count;
+    size_t fixup_size;
+} shark_jit_compiler;
+
+static void jit_byte(shark_jit_compiler *c, uint8_t x)
+{
+    if (c->size == c->capacity) {
+        c->capacity = c->capacity == 0 ? 4096 : c->capacity << 1;
+        c->data = shark_realloc(c->data, c->capacity);
+    }
+    c->data[c->size++] = x;
+}
+
+static void jit_int(shark_jit_compiler *c, uint32_t x)
+{
+    for (int i = 0; i < 32; i += 8)
+        jit_byte(c, (uint8_t) (x >> i));
+}
+
+static void jit_long(shark_jit_compiler *c, uint64_t x)
+{
+    for (int i = 0; i < 64; i += 8)
+        jit_byte(c, (uint8_t) (x >> i));
+}
+
+static void jit_rex(shark_jit_compiler *c, int w, int reg, int index, int base)
+{
+    uint8_t rex = 0x40 | (w << 3) | ((reg >> 3) << 2) | ((index >> 3) << 1) | (base >> 3);
+    if (rex != 0x40) jit_byte(c, rex);
+}
+
+/* ModRM (and SIB) for [base + disp32] */
+static void jit_mem(shark_jit_compiler *c, int reg, int base, int32_t disp)
+{
+    jit_byte(c, 0x80 | ((reg & 7) << 3) | (base & 7));
+    if ((base & 7) == JIT_RSP) jit_byte(c, 0x24);
+    jit_int(c, (uint32_t) disp);
+}
+
+/* op r64, [base + disp] (or the reverse, depending on op) */
+static void jit_op_mem(shark_jit_compiler *c, uint8_t op, int reg, int base, int32_t disp)
+{
+    jit_rex(c, 1, reg, 0, base);
+    jit_byte(c, op);
+    jit_mem(c, reg, base, disp);
+}
+
+#define jit_load(c, dst, base, disp)    jit_op_mem(c, 0x8B, dst, base, disp)
+#define jit_store(c, base, disp, src)   jit_op_mem(c, 0x89, src, base, disp)
+
+/* op dst, src for the r/m64, r64 forms (mov, add, sub, and, xor, cmp) */
+static void jit_op_reg(shark_jit_compiler *c, uint8_t op, int dst, int src)
+{
+    jit_rex(c, 1, src, 0, dst);
+    jit_byte(c, op);
+    jit_byte(c, 0xC0 | ((src & 7) << 3) | (dst & 7));
+}
+
+#define jit_mov(c, dst, src)    jit_op_reg(c, 0x89, dst, src)
+#define jit_and(c, dst, src)    jit_op_reg(c, 0x21, dst, src)
+#define jit_xor(c, dst, src)    jit_op_reg(c, 0x31, dst, src)
+#define jit_cmp(c, dst, src)    jit_op_reg(c, 0x39, dst, src)
+#define jit_sub(c, dst, src)    jit_op_reg(c, 0x29, dst, src)
+
+/* op dst, imm32 with op one of the 0x81 group extensions */
+static void jit_op_imm(shark_jit_compiler *c, int ext, int dst, int32_t imm)
+{
+    jit_rex(c, 1, 0, 0, dst);
+    jit_byte(c, 0x81);
+    jit_byte(c, 0xC0 | (ext << 3) | (dst & 7));
+    jit_int(c, (uint32_t) imm);
+}
+
+#define jit_add_imm(c, dst, imm)    jit_op_imm(c, 0, dst, imm)
+#define jit_sub_imm(c, dst, imm)    jit_op_imm(c, 5, dst, imm)
+
+static void jit_mov_imm(shark_jit_compiler *c, int dst, uint64_t imm)
+{
+    jit_rex(c, 1, 0, 0, dst);
+    jit_byte(c, 0xB8 + (dst & 7));
+    jit_long(c, imm);
+}
+
+/* shift dst by n, ext is 4 for shl and 7 for sar */
+static void jit_shift(shark_jit_compiler *c, int ext, int dst, uint8_t n)
+{
+    jit_rex(c, 1, 0, 0, dst);
+    jit_byte(c, 0xC1);
+    jit_byte(c, 0xC0 | (ext << 3) | (dst & 7));
+    jit_byte(c, n);
+}
+
+/* lea dst, [base + index * 8] */
+static void jit_lea_index(shark_jit_compiler *c, int dst, int base, int index)
+{
+    jit_rex(c, 1, dst, index, base);
+    jit_byte(c, 0x8D);
+    jit_byte(c, 0x44 | ((dst & 7) << 3));
+    jit_byte(c, 0xC0 | ((index & 7) << 3) | (base & 7));
+    jit_byte(c, 0);
+}
+
+/* scalar double op between an xmm register and [base + disp], or between
+** xmm0 to xmm7 when base is negative */
+static void jit_sse(shark_jit_compiler *c, uint8_t prefix, uint8_t op, int xmm, int base, int32_t disp)
+{
+    jit_byte(c, prefix);
+    if (base < 0) {
+        jit_byte(c, 0x0F);
+        jit_byte(c, op);
+        jit_byte(c, 0xC0 | (xmm << 3) | (-base - 1));
+    } else {
+        jit_rex(c, 0, xmm, 0, base);
+        jit_byte(c, 0x0F);
+        jit_byte(c, op);
+        jit_mem(c, xmm, base, disp);
+    }
+}
+
+#define JIT_XMM(n)  (-(n) - 1)
+
+/* movq xmm, r64 */
+static void jit_movq_to_xmm(shark_jit_compiler *c, int xmm, int src)
+{
+    jit_byte(c, 0x66);
+    jit_rex(c, 1, 0, 0, src);
+    jit_byte(c, 0x0F);
+    jit_byte(c, 0x6E);
+    jit_byte(c, 0xC0 | (xmm << 3) | (src & 7));
+}
+
+static void jit_push_reg(shark_jit_compiler *c, int reg)
+{
+    jit_rex(c, 0, 0, 0, reg);
+    jit_byte(c, 0x50 + (reg & 7));
+}
+
+static void jit_pop_reg(shark_jit_compiler *c, int reg)
+{
+    jit_rex(c, 0, 0, 0, reg);
+    jit_byte(c, 0x58 + (reg & 7));
+}
+
+static void jit_call(shark_jit_compiler *c, void *function)
+{
+    jit_mov_imm(c, JIT_RAX, (uint64_t) function);
+    jit_byte(c, 0xFF);
+    jit_byte(c, 0xD0);
+}
+
+/* Emits a jump (cc is JIT_ALWAYS or a condition code) with its offset left
+** to be patched, and returns the position just after it. */
+static size_t jit_jump(shark_jit_compiler *c, int cc)
+{
+    if (cc == JIT_ALWAYS) {
+        jit_byte(c, 0xE9);
+    } else {
+        jit_byte(c, 0x0F);
+        jit_byte(c, 0x80 + cc);
+    }
+    jit_int(c, 0);
+    return c->size;
+}
+
+static void jit_patch(shark_jit_compiler *c, size_t pos, size_t target)
+{
+    uint32_t offset = (uint32_t) (int32_t) (target - pos);
+    for (int i = 0; i < 4; i++)
+        c->data[pos - 4 + i] = (uint8_t) (offset >> (i * 8));
+}
+
+static void jit_here(shark_jit_compiler *c, size_t pos)
+{
+    jit_patch(c, pos, c->size);
+}
+
+static void jit_fixup(shark_jit_compiler *c, int kind, int cc, size_t target)
+{
+    if (c->fixup_count == c->fixup_size) {
+        c->fixup_size = c->fixup_size == 0 ? 64 : c->fixup_size << 1;
+        c->fixups = shark_realloc(c->fixups, c->fixup_size * sizeof(shark_jit_fixup));
+    }
+    c->fixups[c->fixup_count].kind = kind;
+    c->fixups[c->fixup_count].pos = jit_jump(c, cc);
+    c->fixups[c->fixup_count].target = target;
+    c->fixup_count++;
+}
+
+/* vm->TOS = r14 - vm->stack */
+static void jit_sync(shark_jit_compiler *c)
+{
+    jit_mov(c, JIT_RAX, JIT_TOP);
+    jit_op_mem(c, 0x2B, JIT_RAX, JIT_VM, offsetof(shark_vm, stack));
+    jit_shift(c, 7, JIT_RAX, 3);
+    jit_store(c, JIT_VM, offsetof(shark_vm, TOS), JIT_RAX);
+}
+
+static void jit_reload(shark_jit_compiler *c)
+{
+    jit_load(c, JIT_RAX, JIT_VM, offsetof(shark_vm, stack));
+    jit_load(c, JIT_RCX, JIT_VM, offsetof(shark_vm, TOS));
+    jit_lea_index(c, JIT_TOP, JIT_RAX, JIT_RCX);
+    jit_load(c, JIT_RCX, JIT_FRAME, offsetof(shark_vm_frame, base));
+    jit_lea_index(c, JIT_LOCALS, JIT_RAX, JIT_RCX);
+}
+
+/* jumps to 'target' unless 'reg' holds a number (clobbers rdx) */
+static void jit_check_num(shark_jit_compiler *c, int reg, int kind, size_t target)
+{
+    jit_mov(c, JIT_RDX, reg);
+    jit_and(c, JIT_RDX, JIT_MASK);
+    jit_cmp(c, JIT_RDX, JIT_MASK);
+    jit_fixup(c, kind, JIT_E, target);
+}
+
+/* pushes rax, stack slots don't hold references */
+static void jit_push(shark_jit_compiler *c)
+{
+    jit_store(c, JIT_TOP, 0, JIT_RAX);
+    jit_add_imm(c, JIT_TOP, sizeof(shark_value));
+}
+
+static void jit_pop(shark_jit_compiler *c, int reg)
+{
+    jit_sub_imm(c, JIT_TOP, sizeof(shark_value));
+    jit_load(c, reg, JIT_TOP, 0);
+}
+
+static void jit_helper(shark_jit_compiler *c, shark_jit_helper helper, uint8_t *operands)
+{
+    jit_sync(c);
+    jit_mov(c, JIT_RDI, JIT_VM);
+    jit_mov(c, JIT_RSI, JIT_FRAME);
+    jit_mov_imm(c, JIT_RDX, (uint64_t) operands);
+    jit_call(c, helper);
+    jit_mov(c, JIT_RDX, JIT_RAX);
+    jit_reload(c);
+    jit_byte(c, 0x84);      /* test dl, dl */
+    jit_byte(c, 0xD2);
+}
+
+/* loads a register operand into reg */
+static void jit_load_reg(shark_jit_compiler *c, int reg, uint16_t operand, shark_value *const_table)
+{
+    if (operand & SHARK_REG_CONST)
+        jit_mov_imm(c, reg, const_table[operand & (SHARK_REG_CONST - 1)].INT);
+    else
+        jit_load(c, reg, JIT_LOCALS, operand * sizeof(shark_value));
+}
+
+/* rax = (bool) cc, as a shark value */
+static void jit_set_bool(shark_jit_compiler *c, int cc)
+{
+    jit_byte(c, 0x0F);          /* setcc al */
+    jit_byte(c, 0x90 + cc);
+    jit_byte(c, 0xC0);
+    jit_byte(c, 0x0F);          /* movzx eax, al */
+    jit_byte(c, 0xB6);
+    jit_byte(c, 0xC0);
+    jit_byte(c, 0x48);          /* neg rax */
+    jit_byte(c, 0xF7);
+    jit_byte(c, 0xD8);
+    jit_mov_imm(c, JIT_RCX, JIT_ONE);
+    jit_and(c, JIT_RAX, JIT_RCX);
+}
+
+/* Number operands in rax (x) and rcx (y), the numeric result is left in
+** xmm0. For comparisons the flags are set so that JIT_A or JIT_AE (returned
+** as the condition) hold when the comparison is true. */
+static int jit_num_binop(shark_jit_compiler *c, uint8_t op)
+{
+    jit_movq_to_xmm(c, 0, JIT_RAX);
+    jit_movq_to_xmm(c, 1, JIT_RCX);
+    switch (op)
+    {
+        case OP_ADD: jit_sse(c, 0xF2, 0x58, 0, JIT_XMM(1), 0); return 0;
+        case OP_SUB: jit_sse(c, 0xF2, 0x5C, 0, JIT_XMM(1), 0); return 0;
+        case OP_MUL: jit_sse(c, 0xF2, 0x59, 0, JIT_XMM(1), 0); return 0;
+        case OP_DIV: jit_sse(c, 0xF2, 0x5E, 0, JIT_XMM(1), 0); return 0;
+        case OP_LT: jit_sse(c, 0x66, 0x2E, 1, JIT_XMM(0), 0); return JIT_A;
+        case OP_LE: jit_sse(c, 0x66, 0x2E, 1, JIT_XMM(0), 0); return JIT_AE;
+        case OP_GT: jit_sse(c, 0x66, 0x2E, 0, JIT_XMM(1), 0); return JIT_A;
+        case OP_GE: jit_sse(c, 0x66, 0x2E, 0, JIT_XMM(1), 0); return JIT_AE;
+    }
+    return 0;
+}
+
+#define JIT_INVERT(cc)  ((cc) ^ 1)
+
+/* the generic operator a quickened or fused instruction stands for */
+static uint8_t jit_base_op(uint8_t op)
+{
+    switch (op)
+    {
+        case OP_ADD_NUM: case OP_ADD_R: return OP_ADD;
+        case OP_SUB_NUM: case OP_SUB_R: return OP_SUB;
+        case OP_MUL_NUM: case OP_MUL_R: return OP_MUL;
+        case OP_DIV_NUM: case OP_DIV_R: return OP_DIV;
+        case OP_LT_NUM: case OP_LT_IF: case OP_LT_R_IF: return OP_LT;
+        case OP_LE_NUM: case OP_LE_IF: case OP_LE_R_IF: return OP_LE;
+        case OP_GT_NUM: case OP_GT_IF: case OP_GT_R_IF: return OP_GT;
+        case OP_GE_NUM: case OP_GE_IF: case OP_GE_R_IF: return OP_GE;
+    }
+    return op;
+}
+
+/* Number of operand bytes of an instruction that may appear in a function
+** body, or -1 for anything the JIT can't decode. */
+static int shark_jit_operands(uint8_t op)
+{
+    switch (op)
+    {
+        case OP_END: case OP_NULL: case OP_TRUE: case OP_FALSE:
+        case OP_NOT_IMPLEMENTED: case OP_DUP: case OP_DROP: case OP_SWAP:
+        case OP_MUL: case OP_DIV: case OP_MOD: case OP_ADD: case OP_SUB:
+        case OP_LT: case OP_LE: case OP_GT: case OP_GE: case OP_EQ: case OP_NE:
+        case OP_IN: case OP_NOT_IN: case OP_NEG: case OP_NOT:
+        case OP_GET_INDEX: case OP_SELF: case OP_SIZEOF: case OP_INSTANCEOF:
+        case OP_ARRAY_NEW: case OP_ARRAY_NEW_APPEND: case OP_TABLE_NEW:
+        case OP_TABLE_NEW_INSERT: case OP_RETURN: case OP_INSERT: case OP_APPEND:
+        case OP_SET_INDEX: case OP_GET_INDEX_TOP: case OP_ZERO:
+        case OP_ARRAY_CLOSE: case OP_TABLE_CLOSE: case OP_BAND: case OP_BOR:
+        case OP_BXOR: case OP_BSHL: case OP_BSHR: case OP_BNOT:
+        case OP_ADD_NUM: case OP_SUB_NUM: case OP_MUL_NUM: case OP_DIV_NUM:
+        case OP_LT_NUM: case OP_LE_NUM: case OP_GT_NUM: case OP_GE_NUM:
+            return 0;
+        case OP_LOAD: case OP_EXIT: case OP_FUNCTION_CALL: case OP_SUPER_CALL:
+        case OP_NEW: case OP_STORE: case OP_INC: case OP_SET_INDEX_AU:
+        case OP_LOAD_RETURN:
+            return 1;
+        case OP_LOAD_GLOBAL: case OP_GET_FIELD: case OP_DEFINE_FIELD:
+        case OP_CONST: case OP_STORE_GLOBAL: case OP_SET_STATIC:
+        case OP_SET_FIELD: case OP_GET_FIELD_TOP: case OP_GET_STATIC:
+        case OP_GET_STATIC_TOP: case OP_IF: case OP_JUMP: case OP_LOOP:
+        case OP_OR: case OP_AND: case OP_LOAD_LOAD: case OP_SELF_GET_FIELD:
+        case OP_STORE_AU: case OP_EQ_IF: case OP_NE_IF: case OP_LT_IF:
+        case OP_LE_IF: case OP_GT_IF: case OP_GE_IF:
+        case OP_GET_FIELD_IC: case OP_SET_FIELD_IC: case OP_GET_FIELD_TOP_IC:
+        case OP_SELF_GET_FIELD_IC:
+            return 2;
+        case OP_METHOD_CALL: case OP_SET_FIELD_AU: case OP_SET_STATIC_AU:
+        case OP_LOAD_CONST: case OP_MOVE: case OP_METHOD_CALL_IC:
+        case OP_SET_FIELD_AU_IC:
+            return 3;
+        case OP_LOAD_LOAD_LT_IF:
+            return 4;
+        case OP_ADD_R: case OP_SUB_R: case OP_MUL_R: case OP_DIV_R:
+        case OP_MOD_R:
+            return 5;
+        case OP_EQ_R_IF: case OP_NE_R_IF: case OP_LT_R_IF: case OP_LE_R_IF:
+        case OP_GT_R_IF: case OP_GE_R_IF:
+            return 6;
+    }
+    return -1;
+}
+
+/* Whether the JIT compiles 'op' into something other than an exit to the
+** interpreter. */
+static bool shark_jit_supported(uint8_t op)
+{
+    switch (op)
+    {
+        case OP_END: case OP_NULL: case OP_TRUE: case OP_FALSE: case OP_ZERO:
+        case OP_LOAD: case OP_CONST: case OP_SELF: case OP_STORE:
+        case OP_DUP: case OP_DROP: case OP_SWAP: case OP_EXIT:
+        case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIV: case OP_MOD:
+        case OP_LT: case OP_LE: case OP_GT: case OP_GE: case OP_EQ: case OP_NE:
+        case OP_ADD_NUM: case OP_SUB_NUM: case OP_MUL_NUM: case OP_DIV_NUM:
+        case OP_LT_NUM: case OP_LE_NUM: case OP_GT_NUM: case OP_GE_NUM:
+        case OP_NEG: case OP_NOT: case OP_IF: case OP_JUMP: case OP_LOOP:
+        case OP_INC: case OP_AND: case OP_OR: case OP_RETURN:
+        case OP_LOAD_GLOBAL: case OP_GET_INDEX:
+        case OP_FUNCTION_CALL: case OP_METHOD_CALL_IC: case OP_SUPER_CALL:
+        case OP_NEW: case OP_GET_FIELD_IC: case OP_GET_FIELD_TOP_IC:
+        case OP_SET_FIELD_IC: case OP_SELF_GET_FIELD_IC:
+        case OP_LOAD_LOAD: case OP_LOAD_CONST: case OP_LOAD_RETURN:
+        case OP_STORE_AU: case OP_EQ_IF: case OP_NE_IF: case OP_LT_IF:
+        case OP_LE_IF: case OP_GT_IF: case OP_GE_IF: case OP_LOAD_LOAD_LT_IF:
+        case OP_MOVE: case OP_ADD_R: case OP_SUB_R: case OP_MUL_R:
+        case OP_DIV_R: case OP_MOD_R: case OP_EQ_R_IF: case OP_NE_R_IF:
+        case OP_LT_R_IF: case OP_LE_R_IF: case OP_GT_R_IF: case OP_GE_R_IF:
+            return true;
+    }
+    return false;
+}
+
+/* Emits the template for the instruction at 'pc', 'offset' is its offset in
+** the function bytecode. Templates check their operands before touching the
+** stack, so a failed check can always exit to the interpreter, which then
+** runs the instruction itself (and reports the error). */
+static void shark_jit_instruction(shark_jit_compiler *c, uint8_t *pc, size_t offset)
+{
+    uint8_t op = pc[0];
+    shark_value *const_table = c->function->owner->const_table;
+
+#define SLOT(n)         ((int32_t) ((n) * sizeof(shark_value)))
+#define SHORT(n)        (((uint16_t) pc[n]) | (((uint16_t) pc[n + 1]) << 8))
+#define EXIT_IF(cc)     jit_fixup(c, JIT_FIXUP_EXIT, cc, offset)
+#define JUMP_IF(cc, n)  jit_fixup(c, JIT_FIXUP_JUMP, cc, offset + (n) + SHORT(n))
+
+    switch (op)
+    {
+        case OP_NULL:
+        case OP_FALSE:
+        case OP_ZERO:
+            jit_xor(c, JIT_RAX, JIT_RAX);
+            jit_push(c);
+            break;
+        case OP_TRUE:
+            jit_mov_imm(c, JIT_RAX, JIT_ONE);
+            jit_push(c);
+            break;
+        case OP_LOAD:
+            jit_load(c, JIT_RAX, JIT_LOCALS, SLOT(pc[1]));
+            jit_push(c);
+            break;
+        case OP_SELF:
+            jit_load(c, JIT_RAX, JIT_LOCALS, 0);
+            jit_push(c);
+            break;
+        case OP_CONST: {
+            shark_value value = const_table[SHORT(1)];
+            jit_mov_imm(c, JIT_RAX, value.INT);
+            jit_push(c);
+            break;
+        }
+        case OP_LOAD_LOAD:
+            jit_load(c, JIT_RAX, JIT_LOCALS, SLOT(pc[1]));
+            jit_push(c);
+            jit_load(c, JIT_RAX, JIT_LOCALS, SLOT(pc[2]));
+            jit_push(c);
+            break;
+        case OP_LOAD_CONST: {
+            jit_load(c, JIT_RAX, JIT_LOCALS, SLOT(pc[1]));
+            jit_push(c);
+            shark_value value = const_table[SHORT(2)];
+            jit_mov_imm(c, JIT_RAX, value.INT);
+            jit_push(c);
+            break;
+        }
+        case OP_STORE:
+            jit_pop(c, JIT_RAX);
+            jit_store(c, JIT_LOCALS, SLOT(pc[1]), JIT_RAX);
+            break;
+        case OP_DUP:
+            jit_load(c, JIT_RAX, JIT_TOP, SLOT(-1));
+            jit_push(c);
+            break;
+        case OP_DROP:
+            jit_sub_imm(c, JIT_TOP, sizeof(shark_value));
+            break;
+        case OP_SWAP:
+            jit_load(c, JIT_RAX, JIT_TOP, SLOT(-1));
+            jit_load(c, JIT_RCX, JIT_TOP, SLOT(-2));
+            jit_store(c, JIT_TOP, SLOT(-1), JIT_RCX);
+            jit_store(c, JIT_TOP, SLOT(-2), JIT_RAX);
+            break;
+        case OP_EXIT:
+            jit_sub_imm(c, JIT_TOP, pc[1] * sizeof(shark_value));
+            break;
+        case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIV:
+        case OP_ADD_NUM: case OP_SUB_NUM: case OP_MUL_NUM: case OP_DIV_NUM:
+        case OP_LT: case OP_LE: case OP_GT: case OP_GE:
+        case OP_LT_NUM: case OP_LE_NUM: case OP_GT_NUM: case OP_GE_NUM: {
+            jit_load(c, JIT_RAX, JIT_TOP, SLOT(-2));
+            jit_check_num(c, JIT_RAX, JIT_FIXUP_EXIT, offset);
+            jit_load(c, JIT_RCX, JIT_TOP, SLOT(-1));
+            jit_check_num(c, JIT_RCX, JIT_FIXUP_EXIT, offset);
+            int cc = jit_num_binop(c, jit_base_op(op));
+            if (cc != 0) {
+                jit_set_bool(c, cc);
+                jit_store(c, JIT_TOP, SLOT(-2), JIT_RAX);
+            } else {
+                jit_sse(c, 0xF2, 0x11, 0, JIT_TOP, SLOT(-2));
+            }
+            jit_sub_imm(c, JIT_TOP, sizeof(shark_value));
+            break;
+        }
+        case OP_NEG:
+            jit_load(c, JIT_RAX, JIT_TOP, SLOT(-1));
+            jit_check_num(c, JIT_RAX, JIT_FIXUP_EXIT, offset);
+            jit_mov_imm(c, JIT_RCX, (uint64_t) 1 << 63);
+            jit_xor(c, JIT_RAX, JIT_RCX);
+            jit_store(c, JIT_TOP, SLOT(-1), JIT_RAX);
+            break;
+        case OP_NOT:
+            jit_load(c, JIT_RAX, JIT_TOP, SLOT(-1));
+            jit_check_num(c, JIT_RAX, JIT_FIXUP_EXIT, offset);
+            jit_shift(c, 4, JIT_RAX, 1);
+            jit_set_bool(c, JIT_E);
+            jit_store(c, JIT_TOP, SLOT(-1), JIT_RAX);
+            break;
+        case OP_INC:
+            jit_load(c, JIT_RAX, JIT_LOCALS, SLOT(pc[1]));
+            jit_check_num(c, JIT_RAX, JIT_FIXUP_EXIT, offset);
+            jit_mov_imm(c, JIT_RCX, JIT_ONE);
+            jit_num_binop(c, OP_ADD);
+            jit_sse(c, 0xF2, 0x11, 0, JIT_LOCALS, SLOT(pc[1]));
+            break;
+        case OP_STORE_AU: {
+            uint8_t au = pc[1];
+            if (au != OP_ADD && au != OP_SUB && au != OP_MUL && au != OP_DIV) {
+                EXIT_IF(JIT_ALWAYS);
+                break;
+            }
+            jit_load(c, JIT_RCX, JIT_TOP, SLOT(-1));
+            jit_check_num(c, JIT_RCX, JIT_FIXUP_EXIT, offset);
+            jit_load(c, JIT_RAX, JIT_LOCALS, SLOT(pc[2]));
+            jit_check_num(c, JIT_RAX, JIT_FIXUP_EXIT, offset);
+            jit_num_binop(c, au);
+            jit_sse(c, 0xF2, 0x11, 0, JIT_LOCALS, SLOT(pc[2]));
+            jit_sub_imm(c, JIT_TOP, sizeof(shark_value));
+            break;
+        }
+        case OP_IF:
+            jit_pop(c, JIT_RAX);
+            jit_mov_imm(c, JIT_RCX, JIT_ONE);
+            jit_cmp(c, JIT_RAX, JIT_RCX);
+            JUMP_IF(JIT_NE, 1);
+            break;
+        case OP_JUMP:
+            JUMP_IF(JIT_ALWAYS, 1);
+            break;
+        case OP_LOOP:
+            jit_fixup(c, JIT_FIXUP_JUMP, JIT_ALWAYS, offset + 1 - SHORT(1));
+            break;
+        case OP_AND: {
+            jit_load(c, JIT_RAX, JIT_TOP, SLOT(-1));
+            jit_mov_imm(c, JIT_RCX, JIT_ONE);
+            jit_cmp(c, JIT_RAX, JIT_RCX);
+            size_t taken = jit_jump(c, JIT_E);
+            jit_mov(c, JIT_RDX, JIT_RAX);
+            jit_and(c, JIT_RDX, JIT_MASK);
+            jit_cmp(c, JIT_RDX, JIT_MASK);
+            JUMP_IF(JIT_NE, 1);
+            jit_here(c, taken);
+            jit_sub_imm(c, JIT_TOP, sizeof(shark_value));
+            break;
+        }
+        case OP_OR:
+            jit_load(c, JIT_RAX, JIT_TOP, SLOT(-1));
+            jit_shift(c, 4, JIT_RAX, 1);
+            JUMP_IF(JIT_NE, 1);
+            jit_sub_imm(c, JIT_TOP, sizeof(shark_value));
+            break;
+        case OP_LT_IF: case OP_LE_IF: case OP_GT_IF: case OP_GE_IF: {
+            jit_load(c, JIT_RAX, JIT_TOP, SLOT(-2));
+            jit_check_num(c, JIT_RAX, JIT_FIXUP_EXIT, offset);
+            jit_load(c, JIT_RCX, JIT_TOP, SLOT(-1));
+            jit_check_num(c, JIT_RCX, JIT_FIXUP_EXIT, offset);
+            jit_sub_imm(c, JIT_TOP, 2 * sizeof(shark_value));
+            int cc = jit_num_binop(c, jit_base_op(op));
+            JUMP_IF(JIT_INVERT(cc), 1);
+            break;
+        }
+        case OP_LOAD_LOAD_LT_IF: {
+            jit_load(c, JIT_RAX, JIT_LOCALS, SLOT(pc[1]));
+            jit_check_num(c, JIT_RAX, JIT_FIXUP_EXIT, offset);
+            jit_load(c, JIT_RCX, JIT_LOCALS, SLOT(pc[2]));
+            jit_check_num(c, JIT_RCX, JIT_FIXUP_EXIT, offset);
+            int cc = jit_num_binop(c, OP_LT);
+            JUMP_IF(JIT_INVERT(cc), 3);
+            break;
+        }
+        case OP_MOVE:
+            jit_load_reg(c, JIT_RAX, SHORT(2), const_table);
+            jit_store(c, JIT_LOCALS, SLOT(pc[1]), JIT_RAX);
+            break;
+        case OP_ADD_R: case OP_SUB_R: case OP_MUL_R: case OP_DIV_R: {
+            jit_load_reg(c, JIT_RAX, SHORT(2), const_table);
+            jit_check_num(c, JIT_RAX, JIT_FIXUP_EXIT, offset);
+            jit_load_reg(c, JIT_RCX, SHORT(4), const_table);
+            jit_check_num(c, JIT_RCX, JIT_FIXUP_EXIT, offset);
+            jit_num_binop(c, jit_base_op(op));
+            if (pc[1] == SHARK_REG_PUSH) {
+                jit_sse(c, 0xF2, 0x11, 0, JIT_TOP, 0);
+                jit_load(c, JIT_RAX, JIT_TOP, 0);
+                jit_push(c);
+            } else {
+                jit_sse(c, 0xF2, 0x11, 0, JIT_LOCALS, SLOT(pc[1]));
+            }
+            break;
+        }
+        case OP_LT_R_IF: case OP_LE_R_IF: case OP_GT_R_IF: case OP_GE_R_IF: {
+            jit_load_reg(c, JIT_RAX, SHORT(1), const_table);
+            jit_check_num(c, JIT_RAX, JIT_FIXUP_EXIT, offset);
+            jit_load_reg(c, JIT_RCX, SHORT(3), const_table);
+            jit_check_num(c, JIT_RCX, JIT_FIXUP_EXIT, offset);
+            int cc = jit_num_binop(c, jit_base_op(op));
+            JUMP_IF(JIT_INVERT(cc), 5);
+            break;
+        }
+        case OP_RETURN:
+            jit_pop(c, JIT_RAX);
+            jit_store(c, JIT_RSP, 0, JIT_RAX);
+            jit_fixup(c, JIT_FIXUP_LEAVE, JIT_ALWAYS, 0);
+            break;
+        case OP_LOAD_RETURN:
+            jit_load(c, JIT_RAX, JIT_LOCALS, SLOT(pc[1]));
+            jit_store(c, JIT_RSP, 0, JIT_RAX);
+            jit_fixup(c, JIT_FIXUP_LEAVE, JIT_ALWAYS, 0);
+            break;
+        case OP_END:
+            jit_fixup(c, JIT_FIXUP_END, JIT_ALWAYS, 0);
+            break;
+#define HELPER(helper) \
+            jit_helper(c, helper, pc + 1); \
+            jit_fixup(c, JIT_FIXUP_END, JIT_NE, 0); \
+            break;
+        case OP_MOD:                HELPER(shark_jit_mod)
+        case OP_MOD_R:              HELPER(shark_jit_mod_r)
+        case OP_EQ:                 HELPER(shark_jit_eq)
+        case OP_NE:                 HELPER(shark_jit_ne)
+        case OP_LOAD_GLOBAL:        HELPER(shark_jit_load_global)
+        case OP_GET_INDEX:          HELPER(shark_jit_get_index)
+        case OP_FUNCTION_CALL:      HELPER(shark_jit_function_call)
+        case OP_METHOD_CALL_IC:     HELPER(shark_jit_method_call)
+        case OP_SUPER_CALL:         HELPER(shark_jit_super_call)
+        case OP_NEW:                HELPER(shark_jit_new)
+        case OP_GET_FIELD_IC:       HELPER(shark_jit_get_field)
+        case OP_GET_FIELD_TOP_IC:   HELPER(shark_jit_get_field_top)
+        case OP_SELF_GET_FIELD_IC:  HELPER(shark_jit_self_get_field)
+        case OP_SET_FIELD_IC:       HELPER(shark_jit_set_field)
+#undef HELPER
+#define TEST_HELPER(helper, n) \
+            jit_helper(c, helper, pc + 1); \
+            JUMP_IF(JIT_E, n); \
+            break;
+        case OP_EQ_IF:              TEST_HELPER(shark_jit_eq_if, 1)
+        case OP_NE_IF:              TEST_HELPER(shark_jit_ne_if, 1)
+        case OP_EQ_R_IF:            TEST_HELPER(shark_jit_eq_r_if, 5)
+        case OP_NE_R_IF:            TEST_HELPER(shark_jit_ne_r_if, 5)
+#undef TEST_HELPER
+        default:
+            EXIT_IF(JIT_ALWAYS);
+            break;
+    }
+
+#undef SLOT
+#undef SHORT
+#undef EXIT_IF
+#undef JUMP_IF
+}
+
+static shark_jit_code *shark_jit_compile(shark_function *function)
+{
+    uint8_t *bytecode = function->code.bytecode;
+    size_t code_size = function->code_size;
+
+    shark_jit_compiler compiler;
+    shark_jit_compiler *c = &compiler;
+    memset(c, 0, sizeof(shark_jit_compiler));
+    c->function = function;
+    c->map = shark_malloc((code_size + 1) * sizeof(uint32_t));
+    for (size_t i = 0; i <= code_size; i++)
+        c->map[i] = SHARK_JIT_NO_ENTRY;
+
+    /* prologue, called as entry(vm, frame, start) */
+    jit_push_reg(c, JIT_RBP);
+    jit_push_reg(c, JIT_RBX);
+    jit_push_reg(c, JIT_R12);
+    jit_push_reg(c, JIT_R13);
+    jit_push_reg(c, JIT_R14);
+    jit_sub_imm(c, JIT_RSP, 16);
+    jit_mov(c, JIT_VM, JIT_RDI);
+    jit_mov(c, JIT_FRAME, JIT_RSI);
+    jit_mov_imm(c, JIT_MASK, SHARK_OBJECT_MASK);
+    jit_reload(c);
+    jit_byte(c, 0xFF);      /* jmp rdx */
+    jit_byte(c, 0xE2);
+
+    bool failed = false;
+    size_t offset = 0;
+    while (offset < code_size)
+    {
+        int operands = shark_jit_operands(bytecode[offset]);
+        if (operands < 0 || offset + 1 + operands > code_size) {
+            failed = true;
+            break;
+        }
+        c->map[offset] = (uint32_t) c->size;
+        shark_jit_instruction(c, bytecode + offset, offset);
+        offset += 1 + operands;
+    }
+
+    /* end returns null, leave drops the frame and returns the value in [rsp] */
+    size_t end = c->size;
+    jit_xor(c, JIT_RAX, JIT_RAX);
+    jit_store(c, JIT_RSP, 0, JIT_RAX);
+    size_t leave = c->size;
+    jit_mov(c, JIT_TOP, JIT_LOCALS);
+    jit_sync(c);
+    jit_xor(c, JIT_RAX, JIT_RAX);
+    jit_store(c, JIT_FRAME, offsetof(shark_vm_frame, code), JIT_RAX);
+    jit_load(c, JIT_RAX, JIT_RSP, 0);
+
+    size_t epilogue = c->size;
+    jit_add_imm(c, JIT_RSP, 16);
+    jit_pop_reg(c, JIT_R14);
+    jit_pop_reg(c, JIT_R13);
+    jit_pop_reg(c, JIT_R12);
+    jit_pop_reg(c, JIT_RBX);
+    jit_pop_reg(c, JIT_RBP);
+    jit_byte(c, 0xC3);      /* ret */
+
+    /* exits hand the frame back to the interpreter at their instruction */
+    for (size_t i = 0; i < c->fixup_count && !failed; i++)
+    {
+        shark_jit_fixup *fixup = &c->fixups[i];
+        if (fixup->kind == JIT_FIXUP_END) {
+            jit_patch(c, fixup->pos, end);
+        } else if (fixup->kind == JIT_FIXUP_LEAVE) {
+            jit_patch(c, fixup->pos, leave);
+        } else if (fixup->target >= code_size || c->map[fixup->target] == SHARK_JIT_NO_ENTRY) {
+            failed = true;
+        } else if (fixup->kind == JIT_FIXUP_JUMP) {
+            jit_patch(c, fixup->pos, c->map[fixup->target]);
+        } else {
+            jit_here(c, fixup->pos);
+            jit_sync(c);
+            jit_mov_imm(c, JIT_RAX, (uint64_t) (bytecode + fixup->target));
+            jit_store(c, JIT_FRAME, offsetof(shark_vm_frame, code), JIT_RAX);
+            jit_patch(c, jit_jump(c, JIT_ALWAYS), epilogue);
+        }
+    }
+
+    shark_jit_code *jit = NULL;
+    void *code = MAP_FAILED;
+    size_t size = (c->size + 4095) & ~(size_t) 4095;
+    if (!failed)
+        code = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code != MAP_FAILED) {
+        memcpy(code, c->data, c->size);
+        if (mprotect(code, size, PROT_READ | PROT_EXEC) == 0) {
+            jit = shark_malloc(sizeof(shark_jit_code));
+            jit->code = code;
+            jit->size = size;
+            jit->map = c->map;
+            jit->active = 0;
+            jit->retired = false;
+            c->map = NULL;
+        } else {
+            munmap(code, size);
+        }
+    }
+
+    shark_free(c->data);
+    shark_free(c->fixups);
+    shark_free(c->map);
+    return jit;
+}
+
+/* Runs the function of 'frame' in compiled code from 'start', compiling it
+** first once it gets hot. Returns true with the result of the call when the
+** compiled code finished it, or false when the function isn't compiled (yet)
+** or the compiled code handed the frame back to the interpreter, in which
+** case frame->code points at the instruction to continue from. */
+static inline bool shark_jit_enter(shark_vm *self, shark_vm_frame *frame, uint8_t *start, shark_value *result)
+{
+    if (!shark_jit_enabled || shark_jit_depth >= SHARK_JIT_MAX_DEPTH)
+        return false;
+
+    shark_function *function = frame->function;
+    shark_jit_code *jit = function->jit;
+
+    if (jit == NULL) {
+        if (++function->hotness < SHARK_JIT_THRESHOLD
+        || function->jit_compiles >= SHARK_JIT_MAX_COMPILES)
+            return false;
+        jit = function->jit = shark_jit_compile(function);
+        function->jit_compiles = jit != NULL ? function->jit_compiles + 1 : SHARK_JIT_MAX_COMPILES;
+        if (jit == NULL)
+            return false;
+    }
+
+    uint32_t entry = jit->map[start - function->code.bytecode];
+    if (entry == SHARK_JIT_NO_ENTRY)
+        return false;
+
+    jit->active++;
+    shark_jit_depth++;
+    *result = ((shark_jit_entry) jit->code)(self, frame, jit->code + entry);
+    shark_jit_depth--;
+    jit->active--;
+
+    /* An exit at an instruction the JIT does support means it was quickened
+    ** after the function was compiled, so compile it again later. */
+    if (frame->code != NULL && function->jit == jit && shark_jit_supported(*frame->code)) {
+        function->jit = NULL;
+        function->hotness = 0;
+        jit->retired = true;
+    }
+    if (jit->retired && jit->active == 0)
+        shark_jit_free(jit);
+
+    return frame->code == NULL;
+}
@@ -65,6 +65,38 @@ SHARK_NATIVE(clock)
     return SHARK_FROM_NUM(clock() / (double) CLOCKS_PER_SEC);
 }
 
+SHARK_NATIVE(collect)
+{
+    return SHARK_FROM_INT(shark_vm_collect(vm));
+}
+
+static void shark_lib_set_stat(shark_table *table, char *name, size_t value)
+{
+    shark_string *key = shark_string_new_from_cstr(name);
+    shark_table_set_index(table, SHARK_FROM_PTR(key), SHARK_FROM_INT(value));
+    shark_object_dec_ref(key);
+}
+
+SHARK_NATIVE(gc_stats)
+{
+    shark_gc_stats stats = shark_gc_get_stats();
+    shark_table *table = shark_table_new();
+    shark_lib_set_stat(table, "threshold", stats.threshold);
+    shark_lib_set_stat(table, "roots", stats.roots);
+    shark_lib_set_stat(table, "collections", stats.collections);
+    shark_lib_set_stat(table, "collected", stats.collected);
+    return SHARK_FROM_PTR(table);
+}
+
+SHARK_NATIVE(set_threshold)
+{
+    SHARK_ASSERT_INT(args[0], vm, "argument 1 of 'set_threshold'");
+    if (SHARK_AS_INT(args[0]) < 0)
+        shark_fatal_error(vm, "negative collector threshold.");
+    shark_gc_set_threshold((size_t) SHARK_AS_INT(args[0]));
+    return SHARK_NULL;
+}
+
 static shark_int_t shark_errno = 0;
 
 SHARK_API shark_int_t shark_get_err() {
@@ -140,12 +172,9 @@ SHARK_NATIVE(pcall)
     shark_error *prev_error = vm->error;
     vm->error = &protect_error;
     
+    SHARK_VM_CHECK_STACK(vm, argv->length);
     for (size_t i = 0; i < argv->length; i++)
-    {
         vm->stack[vm->TOS++] = argv->data[i];
-        shark_value_inc_ref(argv->data[i]);
-        if (vm->TOS == vm->stack_size) shark_vm_grow_stack(vm);
-    }
     
     if (callee->type == SHARK_BYTECODE_FUNCTION) {
         result = shark_vm_execute(vm, vm->bottom, module, callee);
@@ -153,8 +182,7 @@ SHARK_NATIVE(pcall)
         shark_vm_frame child = { vm->bottom, module, callee, NULL, NULL, 0, NULL };
         vm->bottom = &child;
         result = callee->code.native_code(vm, vm->stack + vm->TOS - argv->length, vm->error);
-        for (size_t i = 0; i < argv->length; i++)
-            shark_value_dec_ref(vm->stack[--vm->TOS]);
+        vm->TOS -= argv->length;
     }
     
     vm->bottom = vm->bottom->parent;
@@ -719,6 +747,12 @@ SHARK_NATIVE(format)
     return SHARK_FROM_PTR(shark_string_format(SHARK_AS_STR(args[0]), SHARK_AS_ARRAY(args[1])));
 }
 
+SHARK_NATIVE(intern)
+{
+    SHARK_ASSERT_STR(args[0], vm, "argument 1 of 'intern'");
+    return SHARK_FROM_PTR(shark_string_intern(shark_object_inc_ref(SHARK_AS_STR(args[0]))));
+}
+
 SHARK_NATIVE(normal)
 {
     SHARK_ASSERT_STR(args[0], vm, "argument 1 of 'normal'");
@@ -747,9 +781,7 @@ SHARK_NATIVE(normal)
         *iter++ = c;
     }
     size_t final_size = (size_t) (iter - normal->data);
-    normal->data = shark_realloc(normal->data, final_size + 1);
-    normal->data[final_size] = '\0';
-    normal->size = final_size;
+    normal = shark_string_resize(normal, final_size);
     shark_string_init(normal);
     return SHARK_FROM_PTR(normal);
 }
@@ -803,8 +835,8 @@ SHARK_NATIVE(quote)
     }
     *iter++ = '"';
     size_t final_size = (size_t) (iter - quote->data);
-    quote->data = shark_realloc(quote->data, final_size + 1);
-    quote->data[final_size] = '\0';
+    quote = shark_string_resize(quote, final_size);
+    shark_string_init(quote);
     return SHARK_FROM_PTR(quote);
 }
 
@@ -1115,37 +1147,25 @@ SHARK_NATIVE(text_file_read)
     size_t size = (size_t) SHARK_AS_INT(args[1]);
     shark_string *data = shark_string_new_with_size(size);
     size_t new_size = fread(data->data, 1, size, SHARK_AS_FILE(args[0])->buffer);
-    data->data = shark_realloc(data->data, new_size + 1);
-    data->data[new_size] = '\0';
-    data->size = new_size;
+    data = shark_string_resize(data, new_size);
+    shark_string_init(data);
     return SHARK_FROM_PTR(data);
 }
 
 static shark_string *shark_read_line(FILE *source)
 {
     shark_string *line = shark_string_new_with_size(256);
-    size_t step = 0;
-    size_t index = 0;
-    size_t size;
+    size_t size = 0;
     while (true)
     {
-        size_t base = step * 256;
-        for (index = 0; index < 256; index++)
-        {
-            char c = fgetc(source);
-            if (c == EOF || c == '\n')
-                goto end;
-            line->data[base + index] = (uint8_t) c & 0xFF;
-        }
-        line->data = shark_realloc(line->data, line->size + 256 + 1);
-        line->data[line->size + 256] = '\0';
-        step++;
+        int c = fgetc(source);
+        if (c == EOF || c == '\n')
+            break;
+        if (size == line->size)
+            line = shark_string_resize(line, size + 256);
+        line->data[size++] = (uint8_t) c;
     }
-end:
-    size = step * 256 + index;
-    line->data[size] = '\0';
-    line->data = shark_realloc(line->data, size + 1);
-    line->size = size;
+    line = shark_string_resize(line, size);
     shark_string_init(line);
     return line;
 }
@@ -1263,8 +1283,7 @@ SHARK_NATIVE(copy)
         shark_array *source = (shark_array *) object;
         shark_array *copy = shark_array_new();
         shark_array_preallocate(copy, ((shark_array *) object)->length);
-        for (size_t i = 0; i < source->length; i++)
-            copy->data[i] = shark_value_inc_ref(source->data[i]);
+        shark_array_fill(copy, 0, source, 0, source->length);
         copy->length = source->length;
         return SHARK_FROM_PTR(copy);
     } else if (object->type == &shark_table_class) {
@@ -1289,8 +1308,7 @@ SHARK_NATIVE(slice)
     shark_array *slice = shark_array_new();
     size_t size = end - start;
     shark_array_preallocate(slice, size);
-    for (size_t i = 0; i < size; i++)
-        slice->data[i] = shark_value_inc_ref(list->data[start+i]);
+    shark_array_fill(slice, 0, list, start, size);
     slice->length = size;
     return SHARK_FROM_PTR(slice);
 }
@@ -1309,12 +1327,7 @@ SHARK_NATIVE(popindex)
     size_t index = (size_t) SHARK_AS_INT(args[1]);
     if (index < 0 || index >= list->length)
         shark_fatal_error(vm, "array index out of range.");
-    shark_value value = list->data[index];
-    list->length--;
-    for (size_t i = index; i < list->length; i++)
-        list->data[i] = list->data[i+1];
-    shark_array_shrink(list);
-    return value;
+    return shark_array_remove(list, index);
 }
 
 SHARK_NATIVE(array_find)
@@ -1337,12 +1350,9 @@ SHARK_NATIVE(array_concat)
     shark_array *concat = shark_array_new();
     size_t length = x->length + y->length;
     shark_array_preallocate(concat, length);
-    size_t x_size = x->length;
-    for (size_t i = 0; i < x_size; i++)
-        concat->data[i] = shark_value_inc_ref(x->data[i]);
-    size_t y_size = y->length;
-    for (size_t i = 0; i < y_size; i++)
-        concat->data[x_size + i] = shark_value_inc_ref(y->data[i]);
+    shark_array_fill(concat, 0, x, 0, x->length);
+    shark_array_fill(concat, x->length, y, 0, y->length);
+    concat->length = length;
     return SHARK_FROM_PTR(concat);
 }
 
@@ -1353,8 +1363,7 @@ SHARK_NATIVE(extend)
     shark_array *list = SHARK_AS_ARRAY(args[0]);
     shark_array *other = SHARK_AS_ARRAY(args[1]);
     shark_array_preallocate(list, list->length + other->length);
-    for (size_t i = 0; i < other->length; i++)
-        list->data[list->length + i] = shark_value_inc_ref(other->data[i]);
+    shark_array_fill(list, list->length, other, 0, other->length);
     list->length = list->length + other->length;
     return SHARK_NULL;
 }
@@ -1375,31 +1384,35 @@ SHARK_NATIVE(update)
 
 #undef SHARK_NATIVE
 
-SHARK_API void shark_init_library(shark_vm *vm)
+static void shark_bind_exit(shark_vm *vm, shark_module *module)
 {
-    shark_module *module;
-    shark_class *type;
-    shark_function *function;
-    
-    // system.exit
-    module = shark_vm_bind_module(vm, "system.exit");
     shark_vm_bind_function(vm, module, NULL, "exit", 1, shark_lib_exit);
-    
-    // system.time
-    module = shark_vm_bind_module(vm, "system.time");
+}
+
+static void shark_bind_time(shark_vm *vm, shark_module *module)
+{
     shark_vm_bind_function(vm, module, NULL, "clock", 0, shark_lib_clock);
-    
-    // system.error
-    module = shark_vm_bind_module(vm, "system.error");
+}
+
+static void shark_bind_gc(shark_vm *vm, shark_module *module)
+{
+    shark_vm_bind_function(vm, module, NULL, "collect", 0, shark_lib_collect);
+    shark_vm_bind_function(vm, module, NULL, "stats", 0, shark_lib_gc_stats);
+    shark_vm_bind_function(vm, module, NULL, "set_threshold", 1, shark_lib_set_threshold);
+}
+
+static void shark_bind_error(shark_vm *vm, shark_module *module)
+{
     shark_vm_bind_function(vm, module, NULL, "get_err", 0, shark_lib_get_err);
     shark_vm_bind_function(vm, module, NULL, "has_err", 0, shark_lib_has_err);
     shark_vm_bind_function(vm, module, NULL, "set_err", 1, shark_lib_set_err);
     shark_vm_bind_function(vm, module, NULL, "clear_err", 0, shark_lib_clear_err);
     shark_vm_bind_function(vm, module, NULL, "error", 1, shark_lib_error);
     shark_vm_bind_function(vm, module, NULL, "pcall", 2, shark_lib_pcall);
-    
-    // system.path
-    module = shark_vm_bind_module(vm, "system.path");
+}
+
+static void shark_bind_path(shark_vm *vm, shark_module *module)
+{
     shark_vm_bind_function(vm, module, NULL, "get_base", 1, shark_lib_path_get_base);
     shark_vm_bind_function(vm, module, NULL, "get_tail", 1, shark_lib_path_get_tail);
     shark_vm_bind_function(vm, module, NULL, "get_ext", 1, shark_lib_path_get_ext);
@@ -1412,10 +1425,10 @@ SHARK_API void shark_init_library(shark_vm *vm)
     shark_vm_bind_function(vm, module, NULL, "rmdir", 1, shark_lib_rmdir);
     shark_vm_bind_function(vm, module, NULL, "unlink", 1, shark_lib_unlink);
 #endif // CSHARK_NO_FS
-    
-    // system.math
-    module = shark_vm_bind_module(vm, "system.math");
-    
+}
+
+static void shark_bind_math(shark_vm *vm, shark_module *module)
+{
     shark_table_set_index(module->names, SHARK_FROM_PTR(shark_string_new_from_cstr("pi")), SHARK_FROM_NUM(M_PI));
     shark_table_set_index(module->names, SHARK_FROM_PTR(shark_string_new_from_cstr("e")), SHARK_FROM_NUM(M_E));
     
@@ -1440,9 +1453,12 @@ SHARK_API void shark_init_library(shark_vm *vm)
     shark_vm_bind_function(vm, module, NULL, "min", 2, shark_lib_min);
     shark_vm_bind_function(vm, module, NULL, "max", 2, shark_lib_max);
     shark_vm_bind_function(vm, module, NULL, "random", 1, shark_lib_random);
+}
+
+static void shark_bind_string(shark_vm *vm, shark_module *module)
+{
+    shark_class *type;
     
-    // system.string
-    module = shark_vm_bind_module(vm, "system.string");
     shark_vm_bind_function(vm, module, NULL, "itos", 1, shark_lib_itos);
     shark_vm_bind_function(vm, module, NULL, "ftos", 1, shark_lib_ftos);
     shark_vm_bind_function(vm, module, NULL, "ctos", 1, shark_lib_ctos);
@@ -1469,6 +1485,7 @@ SHARK_API void shark_init_library(shark_vm *vm)
     shark_vm_bind_function(vm, module, NULL, "format", 2, shark_lib_format);
     shark_vm_bind_function(vm, module, NULL, "normal", 1, shark_lib_normal);
     shark_vm_bind_function(vm, module, NULL, "quote", 1, shark_lib_quote);
+    shark_vm_bind_function(vm, module, NULL, "intern", 1, shark_lib_intern);
     
     type = shark_strbuf_class = shark_vm_bind_class(vm, module, "strbuf", sizeof(shark_strbuf), shark_strbuf_destroy, false);
     shark_vm_bind_function(vm, module, type, "init", 0, shark_lib_strbuf_init);
@@ -1491,9 +1508,16 @@ SHARK_API void shark_init_library(shark_vm *vm)
     
     shark_vm_bind_function(vm, module, NULL, "encode", 1, shark_lib_encode);
     shark_vm_bind_function(vm, module, NULL, "decode", 1, shark_lib_decode);
+}
+
+static void shark_bind_io(shark_vm *vm, shark_module *module)
+{
+    shark_class *type;
     
-    // system.io
-    module = shark_vm_bind_module(vm, "system.io");
+    /* binary files are read into bytes objects, whose class is bound there */
+    shark_string *string_module = shark_string_new_from_cstr("system.string");
+    shark_vm_import_module(vm, string_module);
+    shark_object_dec_ref(string_module);
     
     type = shark_text_file_class = shark_vm_bind_class(vm, module, "text_file", sizeof(shark_file), shark_default_destroy, false);
     shark_vm_bind_function(vm, module, type, "put", 1, shark_lib_text_file_put);
@@ -1517,10 +1541,10 @@ SHARK_API void shark_init_library(shark_vm *vm)
     shark_vm_bind_function(vm, module, NULL, "puts", 1, shark_lib_puts);
     shark_vm_bind_function(vm, module, NULL, "printf", 2, shark_lib_printf);
     shark_vm_bind_function(vm, module, NULL, "read_line", 0, shark_lib_read_line);
-    
-    // system.util
-    module = shark_vm_bind_module(vm, "system.util");
-    
+}
+
+static void shark_bind_util(shark_vm *vm, shark_module *module)
+{
     shark_vm_bind_function(vm, module, NULL, "copy", 1, shark_lib_copy);
     shark_vm_bind_function(vm, module, NULL, "slice", 3, shark_lib_slice);
     shark_vm_bind_function(vm, module, NULL, "pop", 1, shark_lib_pop);
@@ -1531,3 +1555,17 @@ SHARK_API void shark_init_library(shark_vm *vm)
     shark_vm_bind_function(vm, module, NULL, "remove", 2, shark_lib_remove);
     shark_vm_bind_function(vm, module, NULL, "update", 2, shark_lib_update);
 }
+
+/* Modules are only bound once a program imports them. */
+SHARK_API void shark_init_library(shark_vm *vm)
+{
+    shark_vm_register_module(vm, "system.exit", shark_bind_exit);
+    shark_vm_register_module(vm, "system.time", shark_bind_time);
+    shark_vm_register_module(vm, "system.gc", shark_bind_gc);
+    shark_vm_register_module(vm, "system.error", shark_bind_error);
+    shark_vm_register_module(vm, "system.path", shark_bind_path);
+    shark_vm_register_module(vm, "system.math", shark_bind_math);
+    shark_vm_register_module(vm, "system.string", shark_bind_string);
+    shark_vm_register_module(vm, "system.io", shark_bind_io);
+    shark_vm_register_module(vm, "system.util", shark_bind_util);
+}
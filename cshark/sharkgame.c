@@ -533,13 +533,7 @@ void shark_exec_game(shark_vm *vm)
     if (main->display == NULL) shark_fatal_error(NULL, "could not initialize display.");
 #endif
     
-#define PUSH(value) { \
-                    shark_value __PUSH_VALUE__ = value; \
-                    vm->stack[vm->TOS++] = __PUSH_VALUE__; \
-                    shark_value_inc_ref(__PUSH_VALUE__); \
-                    if (vm->TOS == vm->stack_size) \
-                        shark_vm_grow_stack(vm); \
-                }
+#define PUSH(value)     (vm->stack[vm->TOS++] = (value))
     
 #define SHARK_CALL_METHOD(name) \
     { \
@@ -553,8 +547,7 @@ void shark_exec_game(shark_vm *vm)
         } else { \
             method->code.native_code(vm, vm->stack, &error); \
         } \
-        while (vm->TOS > 0) \
-            shark_value_dec_ref(vm->stack[--vm->TOS]); \
+        vm->TOS = 0; \
     }
     
     PUSH(SHARK_FROM_PTR(main));